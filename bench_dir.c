@@ -0,0 +1,82 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "server_mfs.h"
+
+// Per-operation cost of lookup, create and unlink as directories fill up.
+// Usage: bench_dir [iterations]. The server's per-request chatter is discarded.
+
+#define BENCH_IMAGE "bench_dir"
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+
+    // keep a handle on the terminal for the results, then silence stdout/stderr
+    FILE* out = fdopen(dup(STDERR_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+
+    unlink(BENCH_IMAGE ".mfsi");
+    unlink(BENCH_IMAGE ".mfsj");
+    FSImage* my_fsi = SMFS_open_file_system_image(BENCH_IMAGE, FSI_BUFFERED);
+    if (my_fsi == NULL)
+        return 1;
+
+    int const fills[] = { 2, 16, 64, 160, 1000, 10000, 100000 };
+    fprintf(out, "%8s %14s %14s %16s\n", "entries", "lookup ns/op", "miss ns/op", "creat+unlink ns");
+    for (int f = 0; f < sizeof fills / sizeof fills[0]; f++) {
+        char name[DNAME_MAX];
+        sprintf(name, "dir-%d", fills[f]);
+        SMFS_create_file(my_fsi, 0, I_DIRECTORY, name);
+        int pinum = SMFS_lookup(my_fsi, 0, name);
+
+        // "." and ".." count towards the entries
+        SMFS_begin_group(my_fsi);
+        for (int i = 2; i < fills[f]; i++) {
+            sprintf(name, "entry-%d", i);
+            SMFS_create_file(my_fsi, pinum, I_FILE, name);
+        }
+        SMFS_end_group(my_fsi);
+
+        // look up every entry in turn, then names that aren't there
+        double start = now_ns();
+        for (int i = 0; i < iterations; i++) {
+            sprintf(name, "entry-%d", 2 + i % (fills[f] > 2 ? fills[f] - 2 : 1));
+            SMFS_lookup(my_fsi, pinum, fills[f] > 2 ? name : ".");
+        }
+        double lookup_ns = (now_ns() - start) / iterations;
+
+        start = now_ns();
+        for (int i = 0; i < iterations; i++) {
+            sprintf(name, "missing-%d", i);
+            SMFS_lookup(my_fsi, pinum, name);
+        }
+        double miss_ns = (now_ns() - start) / iterations;
+
+        // one log fsync per group so the directory work isn't hidden behind the disk
+        start = now_ns();
+        SMFS_begin_group(my_fsi);
+        for (int i = 0; i < iterations; i++) {
+            SMFS_create_file(my_fsi, pinum, I_FILE, "scratch");
+            SMFS_unlink(my_fsi, pinum, "scratch");
+        }
+        SMFS_end_group(my_fsi);
+        double churn_ns = (now_ns() - start) / iterations;
+
+        fprintf(out, "%8d %14.0f %14.0f %16.0f\n", fills[f], lookup_ns, miss_ns, churn_ns);
+    }
+
+    unlink(BENCH_IMAGE ".mfsi");
+    unlink(BENCH_IMAGE ".mfsj");
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mfs.h"
+#include "udp.h"
+
+// Request throughput of a running server: clients threads each keep window requests in flight on their own
+// socket for the given number of seconds. Run it against `server -b 1` (one system call per datagram) and
+// the default batched loop to compare.
+// Usage: bench_udp host port [seconds] [clients] [window] [stat|read|write]
+
+typedef struct bench_client_ {
+    pthread_t thread;
+    struct sockaddr_in server;
+    int op;
+    int inum;
+    int window;
+    double seconds;
+    long replies;
+    long timeouts;
+} bench_client;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int fill_request(MFS_Request* request, int op, int inum, uint32_t request_id) {
+    request->hdr = (MFS_Header){ .version = MFS_PROTOCOL_VERSION, .opcode = op, .request_id = request_id };
+    request->inum = inum;
+    request->arg = 0;
+    if (op == MFS_OP_WRITE)
+        request->hdr.length = MFS_BLOCK_SIZE;
+    return MFS_REQUEST_HEADER_SIZE + request->hdr.length;
+}
+
+// one blocking request on sd, for setting up the file the read and write runs use
+static int call(int sd, struct sockaddr_in* server, int op, int inum, int arg, void const* data, int length) {
+    static MFS_Request request;
+    static MFS_Reply reply;
+    request.hdr = (MFS_Header){ .version = MFS_PROTOCOL_VERSION, .opcode = op, .length = length };
+    request.inum = inum;
+    request.arg = arg;
+    memcpy(request.data, data, length);
+    UDP_Write(sd, server, (char*)&request, MFS_REQUEST_HEADER_SIZE + length);
+    struct sockaddr_in from;
+    if (UDP_Read(sd, &from, (char*)&reply, sizeof reply) < (int)MFS_REPLY_HEADER_SIZE)
+        return -1;
+    return reply.return_val;
+}
+
+static void* client_main(void* arg) {
+    bench_client* client = arg;
+    int sd = UDP_Open(0);
+    assert(sd > -1);
+    struct timeval timeout = { .tv_usec = 200000 };
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+    MFS_Request request = {0};
+    MFS_Reply reply;
+    struct sockaddr_in from;
+    uint32_t request_id = 0;
+    double deadline = now_sec() + client->seconds;
+    while (now_sec() < deadline) {
+        // (re)fill the window, then send one more request for every reply
+        for (int i = 0; i < client->window; i++) {
+            int size = fill_request(&request, client->op, client->inum, ++request_id);
+            UDP_Write(sd, &client->server, (char*)&request, size);
+        }
+        while (now_sec() < deadline) {
+            if (UDP_Read(sd, &from, (char*)&reply, sizeof reply) < 0) {
+                ++(client->timeouts);
+                break;
+            }
+            ++(client->replies);
+            int size = fill_request(&request, client->op, client->inum, ++request_id);
+            UDP_Write(sd, &client->server, (char*)&request, size);
+        }
+    }
+    UDP_Close(sd);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        printf("Usage: bench_udp host port [seconds] [clients] [window] [stat|read|write]\n");
+        return 1;
+    }
+    double seconds = argc > 3 ? atof(argv[3]) : 5;
+    int clients = argc > 4 ? atoi(argv[4]) : 8;
+    int window = argc > 5 ? atoi(argv[5]) : 4;
+    char const* op_name = argc > 6 ? argv[6] : "stat";
+    int op = strcmp(op_name, "read") == 0 ? MFS_OP_READ : strcmp(op_name, "write") == 0 ? MFS_OP_WRITE : MFS_OP_STAT;
+
+    struct sockaddr_in server;
+    int rc = UDP_FillSockAddr(&server, argv[1], atoi(argv[2]));
+    assert(rc == 0);
+
+    // the read and write runs go to block 0 of one file
+    int inum = 0;
+    if (op != MFS_OP_STAT) {
+        static char block[MFS_BLOCK_SIZE];
+        int sd = UDP_Open(0);
+        call(sd, &server, MFS_OP_CREAT, 0, MFS_REGULAR_FILE, "bench_udp", sizeof "bench_udp");
+        inum = call(sd, &server, MFS_OP_LOOKUP, 0, 0, "bench_udp", sizeof "bench_udp");
+        assert(inum > 0);
+        call(sd, &server, MFS_OP_WRITE, inum, 0, block, sizeof block);
+        UDP_Close(sd);
+    }
+
+    bench_client* all = calloc(clients, sizeof *all);
+    for (int i = 0; i < clients; i++) {
+        all[i] = (bench_client){ .server = server, .op = op, .inum = inum, .window = window, .seconds = seconds };
+        pthread_create(&all[i].thread, NULL, client_main, &all[i]);
+    }
+    long replies = 0, timeouts = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(all[i].thread, NULL);
+        replies += all[i].replies;
+        timeouts += all[i].timeouts;
+    }
+    printf("%s: %d clients x %d in flight, %.0f requests/s (%ld timeouts)\n",
+        op_name, clients, window, replies / seconds, timeouts);
+    free(all);
+    return 0;
+}
@@ -1,4 +1,8 @@
 // borrowed heavily from: http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "bitarray.h"
 
 void set_bit(bitarray ba, int32_t k) {
@@ -35,6 +39,144 @@ bool test_bit(bitarray ba, int32_t k) {
         return false;
 }
 
+// 64 bits of the array starting at bit w*64 (words are little endian, so bit k of the word is bit w*64+k)
+static uint64_t load_word64(bitarray ba, int32_t w) {
+    uint64_t word;
+    memcpy(&word, &ba[w*2], sizeof word);
+    return word;
+}
+
+// bits [0, nbits - w*64) of the 64-bit word w, i.e. the ones that are inside the array
+static uint64_t valid_mask(int32_t nbits, int32_t w) {
+    int32_t valid = nbits - w*64;
+    return valid >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << valid) - 1);
+}
+
+int32_t count_zero_bits(bitarray ba, int32_t nbits) {
+    int32_t ones = 0;
+    int32_t nwords = (nbits + 63) / 64;
+    for (int32_t w = 0; w < nwords; w++) {
+        ones += __builtin_popcountll(load_word64(ba, w) & valid_mask(nbits, w));
+    }
+    return nbits - ones;
+}
+
+void init_hint(bitarray ba, int32_t nbits, bitarray_hint* hint) {
+    hint->next = 0;
+    hint->free = count_zero_bits(ba, nbits);
+}
+
+// skip over 64-bit words that are completely set, 128/256 bits per compare when SIMD is available
+static int32_t skip_full_words(bitarray ba, int32_t w, int32_t nwords) {
+#if defined(__AVX2__)
+    __m256i const ones = _mm256_set1_epi32(-1);
+    while (w + 4 <= nwords) {
+        __m256i v = _mm256_loadu_si256((__m256i const*)&ba[w*2]);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, ones)) != -1)
+            break;
+        w += 4;
+    }
+#elif defined(__SSE2__)
+    __m128i const ones = _mm_set1_epi32(-1);
+    while (w + 2 <= nwords) {
+        __m128i v = _mm_loadu_si128((__m128i const*)&ba[w*2]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, ones)) != 0xffff)
+            break;
+        w += 2;
+    }
+#endif
+    return w;
+}
+
+/*
+Find a zero bit in [0, nbits), set it and return its index, or -1 if every bit is set.
+Starts at hint->next and wraps around once, scanning 64 bits per step with ctz.
+nbits must be a multiple of 32 (whole int32_t words).
+*/
+int32_t find_zero_and_set(bitarray ba, int32_t nbits, bitarray_hint* hint) {
+    if (hint->free <= 0)
+        return -1;
+
+    int32_t nwords = (nbits + 63) / 64;
+    int32_t start = hint->next < nbits ? hint->next : 0;
+    int32_t w = start / 64;
+    uint64_t below_start = ((uint64_t)1 << (start % 64)) - 1;
+
+    for (int32_t scanned = 0; scanned <= nwords; scanned++) {
+        uint64_t zeros = ~load_word64(ba, w) & valid_mask(nbits, w);
+        if (scanned == 0)
+            zeros &= ~below_start; // first pass over the start word only looks at or after start
+        if (zeros) {
+            int32_t k = w*64 + __builtin_ctzll(zeros);
+            set_bit(ba, k);
+            --(hint->free);
+            hint->next = k + 1 < nbits ? k + 1 : 0;
+            return k;
+        }
+
+        int32_t next_w = skip_full_words(ba, w + 1, nwords);
+        scanned += next_w - (w + 1);
+        w = next_w < nwords ? next_w : 0;
+    }
+    return -1;
+}
+
+// first zero bit in [from, nbits), -1 if there is none
+static int32_t find_next_zero(bitarray ba, int32_t nbits, int32_t from) {
+    int32_t nwords = (nbits + 63) / 64;
+    for (int32_t w = from / 64; w < nwords; w = skip_full_words(ba, w + 1, nwords)) {
+        uint64_t zeros = ~load_word64(ba, w) & valid_mask(nbits, w);
+        if (w == from / 64)
+            zeros &= ~(((uint64_t)1 << (from % 64)) - 1);
+        if (zeros)
+            return w*64 + __builtin_ctzll(zeros);
+    }
+    return -1;
+}
+
+// first run of `length` zero bits starting in [from, to), -1 if there is none
+static int32_t find_zero_run(bitarray ba, int32_t nbits, int32_t length, int32_t from, int32_t to) {
+    int32_t k = find_next_zero(ba, nbits, from);
+    while (k > -1 && k < to) {
+        int32_t run = 1;
+        while (run < length && k + run < nbits && !test_bit(ba, k + run))
+            ++run;
+        if (run == length)
+            return k;
+        k = find_next_zero(ba, nbits, k + run);
+    }
+    return -1;
+}
+
+/*
+Find `length` consecutive zero bits, set them and return the index of the first, or -1 if no run that
+long exists. Next-fit like find_zero_and_set().
+*/
+int32_t find_zero_run_and_set(bitarray ba, int32_t nbits, int32_t length, bitarray_hint* hint) {
+    if (hint->free < length)
+        return -1;
+
+    int32_t start = hint->next < nbits ? hint->next : 0;
+    int32_t k = find_zero_run(ba, nbits, length, start, nbits);
+    if (k < 0)
+        k = find_zero_run(ba, nbits, length, 0, start);
+    if (k < 0)
+        return -1;
+
+    for (int32_t i = k; i < k + length; i++)
+        set_bit(ba, i);
+    hint->free -= length;
+    hint->next = k + length < nbits ? k + length : 0;
+    return k;
+}
+
+void release_bit(bitarray ba, int32_t k, bitarray_hint* hint) {
+    if (test_bit(ba, k)) {
+        clear_bit(ba, k);
+        ++(hint->free);
+    }
+}
+
 // #include <stdio.h>
 // int main() {
 //     bitarray b = {0};
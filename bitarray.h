@@ -5,6 +5,18 @@
 
 typedef int32_t bitarray[128]; // 128 * 4 = 4096
 
+// allocation state kept alongside a bitarray used as a free map
+typedef struct bitarray_hint_ {
+    int32_t next; // next-fit: where the next search for a zero bit starts
+    int32_t free; // number of zero bits in [0, nbits)
+} bitarray_hint;
+
 void set_bit(bitarray ba, int32_t k);
 void clear_bit(bitarray ba, int32_t k);
-bool test_bit(bitarray ba, int32_t k);
\ No newline at end of file
+bool test_bit(bitarray ba, int32_t k);
+
+int32_t count_zero_bits(bitarray ba, int32_t nbits);
+void    init_hint(bitarray ba, int32_t nbits, bitarray_hint* hint);
+int32_t find_zero_and_set(bitarray ba, int32_t nbits, bitarray_hint* hint);
+int32_t find_zero_run_and_set(bitarray ba, int32_t nbits, int32_t length, bitarray_hint* hint);
+void    release_bit(bitarray ba, int32_t k, bitarray_hint* hint);
@@ -23,10 +23,10 @@ int timeout(int fd, char* server_name, char* server_port) {
 
     // char message[BUFFER_SIZE];
     // sprintf(message, "hello world");
-    MFS_ClientToServer request = { .cmd = "TESTCMD"};
+    MFS_Request request = { .hdr = { .version = MFS_PROTOCOL_VERSION, .opcode = MFS_OP_STAT } };
 
 
-    int writebytes = UDP_Write(fd, &addr, (char*)&request, sizeof request); //write message to server@specified-port
+    int writebytes = UDP_Write(fd, &addr, (char*)&request, MFS_REQUEST_HEADER_SIZE); //write message to server@specified-port
     printf("CLIENT:: sent message (%d)\n", writebytes);
 
 
@@ -45,9 +45,9 @@ int timeout(int fd, char* server_name, char* server_port) {
       continue;
     }
 
-    MFS_ServerToClient response;
-	  int readbytes = UDP_Read(fd, &addr2, (char*)&response, sizeof response); //read message from ...
-	  printf("CLIENT:: read %d bytes (message: '%s')\n", readbytes, response.buffer);
+    MFS_Reply reply;
+	  int readbytes = UDP_Read(fd, &addr2, (char*)&reply, sizeof reply); //read message from ...
+	  printf("CLIENT:: read %d bytes (return_val: %d)\n", readbytes, reply.return_val);
 
     
   }
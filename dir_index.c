@@ -0,0 +1,112 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dir_index.h"
+
+#define DIR_INDEX_MIN_CAP 64
+
+static uint32_t hash_name(int32_t pinum, char const* name) {
+    // FNV-1a over the parent inum then the name
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 4; i++) {
+        hash ^= (uint8_t)(pinum >> (8 * i));
+        hash *= 16777619u;
+    }
+    for (; *name; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void place(dir_index* idx, dir_index_entry const* entry) {
+    size_t mask = idx->cap - 1;
+    size_t i = entry->hash & mask;
+    while (idx->table[i].name != NULL)
+        i = (i + 1) & mask;
+    idx->table[i] = *entry;
+}
+
+static void grow(dir_index* idx) {
+    dir_index_entry* old = idx->table;
+    size_t old_cap = idx->cap;
+    idx->cap = old_cap ? old_cap * 2 : DIR_INDEX_MIN_CAP;
+    idx->table = calloc(idx->cap, sizeof *idx->table);
+    assert(idx->table != NULL);
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name != NULL)
+            place(idx, &old[i]);
+    }
+    free(old);
+}
+
+dir_index_entry* dir_index_find(dir_index* idx, int32_t pinum, char const* name) {
+    if (idx->count == 0)
+        return NULL;
+    uint32_t hash = hash_name(pinum, name);
+    size_t mask = idx->cap - 1;
+    for (size_t i = hash & mask; idx->table[i].name != NULL; i = (i + 1) & mask) {
+        dir_index_entry* entry = &idx->table[i];
+        if (entry->hash == hash && entry->pinum == pinum && strcmp(entry->name, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/*
+Add an entry. name must point at the name stored in the directory block, the index doesn't copy it.
+*/
+void dir_index_insert(dir_index* idx, int32_t pinum, char const* name, int32_t inum, uint16_t lblk, uint16_t slot) {
+    // keep the load factor at or below 1/2 so probe sequences stay short
+    if (2 * (idx->count + 1) > idx->cap)
+        grow(idx);
+    dir_index_entry entry = {
+        .name  = name,
+        .hash  = hash_name(pinum, name),
+        .pinum = pinum,
+        .inum  = inum,
+        .lblk  = lblk,
+        .slot  = slot,
+    };
+    place(idx, &entry);
+    ++(idx->count);
+}
+
+void dir_index_remove(dir_index* idx, dir_index_entry* entry) {
+    size_t mask = idx->cap - 1;
+    size_t hole = entry - idx->table;
+    // shift back every following entry of the probe run whose home slot doesn't lie in (hole, i]
+    for (size_t i = (hole + 1) & mask; idx->table[i].name != NULL; i = (i + 1) & mask) {
+        size_t home = idx->table[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            idx->table[hole] = idx->table[i];
+            hole = i;
+        }
+    }
+    memset(&idx->table[hole], 0, sizeof idx->table[hole]);
+    --(idx->count);
+}
+
+bool dir_index_loaded(dir_index const* idx, int32_t pinum) {
+    return (size_t)pinum / 32 < idx->loaded_words && test_bit(idx->loaded, pinum);
+}
+
+void dir_index_set_loaded(dir_index* idx, int32_t pinum, bool loaded) {
+    size_t words = (size_t)pinum / 32 + 1;
+    if (words > idx->loaded_words) {
+        if (!loaded)
+            return;
+        // the volume grows, the bitmap follows the highest inode number it has seen
+        size_t cap = idx->loaded_words ? idx->loaded_words : sizeof(bitarray) / sizeof(int32_t);
+        while (cap < words)
+            cap *= 2;
+        idx->loaded = realloc(idx->loaded, cap * sizeof *idx->loaded);
+        assert(idx->loaded != NULL);
+        memset(idx->loaded + idx->loaded_words, 0, (cap - idx->loaded_words) * sizeof *idx->loaded);
+        idx->loaded_words = cap;
+    }
+    if (loaded)
+        set_bit(idx->loaded, pinum);
+    else
+        clear_bit(idx->loaded, pinum);
+}
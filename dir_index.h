@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "bitarray.h"
+
+// In-memory hash index over directory entries, keyed by (parent inum, name). It is never written to disk:
+// a directory's entries are loaded the first time it is searched and kept in sync with its blocks after that.
+// Open addressing with linear probing, deletions shift the following entries back so no tombstones are needed.
+
+typedef struct dir_index_entry_ {
+    char const* name;  // name of the entry in its directory block, NULL = unused slot
+    uint32_t    hash;
+    int32_t     pinum;
+    int32_t     inum;
+    uint16_t    lblk;  // directory file block holding the entry
+    uint16_t    slot;  // index into that block's d_entries, or the record's offset in a hashed directory's bucket
+} dir_index_entry;
+
+typedef struct dir_index_ {
+    dir_index_entry* table;
+    size_t           cap;    // power of two, 0 until the first insert
+    size_t           count;
+    int32_t*         loaded; // bit per inode: directories whose entries are all in the table
+    size_t           loaded_words;
+} dir_index;
+
+// pointers returned by dir_index_find() are invalidated by the next insert or remove
+dir_index_entry* dir_index_find   (dir_index* idx, int32_t pinum, char const* name);
+void             dir_index_insert (dir_index* idx, int32_t pinum, char const* name, int32_t inum, uint16_t lblk, uint16_t slot);
+void             dir_index_remove (dir_index* idx, dir_index_entry* entry);
+bool             dir_index_loaded (dir_index const* idx, int32_t pinum);
+void             dir_index_set_loaded (dir_index* idx, int32_t pinum, bool loaded);
@@ -0,0 +1,155 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+static uint32_t fnv1a(char const* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void reserve(journal* j, size_t extra) {
+    if (j->len + extra <= j->cap)
+        return;
+    size_t cap = j->cap ? j->cap : 4 * 4096;
+    while (cap < j->len + extra)
+        cap *= 2;
+    j->buf = realloc(j->buf, cap);
+    assert(j->buf != NULL);
+    j->cap = cap;
+}
+
+/*
+Open (or create) the log file. Existing records are left in place for journal_replay().
+*/
+int journal_open(journal* j, char const* filename) {
+    memset(j, 0, sizeof *j);
+    j->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    if (j->fd < 0) {
+        perror("open journal");
+        return -1;
+    }
+    struct stat statbuf;
+    fstat(j->fd, &statbuf);
+    j->size = statbuf.st_size;
+    return 0;
+}
+
+void journal_begin(journal* j) {
+    j->len = 0;
+    j->region_count = 0;
+    reserve(j, sizeof(journal_record));
+    j->len = sizeof(journal_record);
+}
+
+void journal_add(journal* j, uint64_t offset, void const* data, uint32_t length) {
+    reserve(j, sizeof(journal_region) + length);
+    journal_region region = { .offset = offset, .length = length };
+    memcpy(j->buf + j->len, &region, sizeof region);
+    memcpy(j->buf + j->len + sizeof region, data, length);
+    j->len += sizeof region + length;
+    ++(j->region_count);
+}
+
+/*
+Append the record built since journal_begin(). Not durable until journal_sync().
+Returns false if the record was empty and nothing was appended.
+*/
+bool journal_end(journal* j) {
+    if (j->region_count == 0)
+        return false;
+
+    journal_record record = {
+        .magic        = JOURNAL_MAGIC,
+        .seq          = ++(j->seq),
+        .region_count = j->region_count,
+        .length       = j->len - sizeof record,
+    };
+    record.checksum = fnv1a(j->buf + sizeof record, record.length);
+    memcpy(j->buf, &record, sizeof record);
+
+    char const* ptr = j->buf;
+    size_t left_to_write = j->len;
+    while (left_to_write > 0) {
+        ssize_t written = write(j->fd, ptr, left_to_write);
+        assert(written > -1);
+        ptr += written;
+        left_to_write -= written;
+    }
+    j->size += j->len;
+    return true;
+}
+
+/*
+Make every record appended before the call durable. Only the descriptor is used, so this can run without
+the lock that serializes appends; records appended while it runs may or may not be covered.
+*/
+void journal_sync(journal const* j) {
+    fdatasync(j->fd);
+}
+
+/*
+Hand every complete record's regions to apply(), in log order. Replay stops at the first torn or
+corrupt record, which can only be the tail that was being written when the server died.
+Returns the number of records replayed.
+*/
+int journal_replay(journal* j, journal_apply_fn apply, void* ctx) {
+    if (j->size == 0)
+        return 0;
+
+    char* log = malloc(j->size);
+    assert(log != NULL);
+    size_t log_len = 0;
+    while (log_len < (size_t)j->size) {
+        ssize_t bytes_read = pread(j->fd, log + log_len, j->size - log_len, log_len);
+        if (bytes_read <= 0)
+            break;
+        log_len += bytes_read;
+    }
+
+    int replayed = 0;
+    size_t pos = 0;
+    while (pos + sizeof(journal_record) <= log_len) {
+        journal_record record;
+        memcpy(&record, log + pos, sizeof record);
+        char const* payload = log + pos + sizeof record;
+        if (record.magic != JOURNAL_MAGIC ||
+            pos + sizeof record + record.length > log_len ||
+            record.checksum != fnv1a(payload, record.length)) {
+            fprintf(stderr, "ERROR: (journal_replay) discarding torn log tail at offset %zu\n", pos);
+            break;
+        }
+
+        size_t region_pos = 0;
+        for (uint32_t i = 0; i < record.region_count; i++) {
+            journal_region region;
+            memcpy(&region, payload + region_pos, sizeof region);
+            apply(ctx, region.offset, payload + region_pos + sizeof region, region.length);
+            region_pos += sizeof region + region.length;
+        }
+        j->seq = record.seq;
+        pos += sizeof record + record.length;
+        ++replayed;
+    }
+
+    free(log);
+    return replayed;
+}
+
+/*
+Discard all records. Only safe once every logged region has been written back to the image and synced.
+*/
+void journal_reset(journal* j) {
+    int rc = ftruncate(j->fd, 0);
+    assert(rc == 0);
+    fdatasync(j->fd);
+    j->size = 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Redo log of physical image regions. Each record is one transaction: a header followed by
+// (offset, length, data) regions. Records are appended with write() and made durable by
+// journal_sync(), so several records can share one fsync (group commit).
+
+#define JOURNAL_MAGIC 0x4c4a464d // "MFJL" on disk
+
+typedef struct journal_record_ {
+    uint32_t magic;
+    uint32_t checksum;     // FNV-1a over the payload
+    uint64_t seq;
+    uint32_t region_count;
+    uint32_t length;       // payload bytes following this header
+} journal_record;
+
+typedef struct journal_region_ {
+    uint64_t offset;       // offset in the image
+    uint32_t length;       // data bytes following this header
+    uint32_t reserved;
+} journal_region;
+
+typedef struct journal_ {
+    int      fd;
+    uint64_t seq;          // seq of the last appended record
+    off_t    size;         // bytes in the log file
+    uint32_t region_count; // regions in the record being built
+    char*    buf;          // record being built
+    size_t   len;
+    size_t   cap;
+} journal;
+
+typedef void (*journal_apply_fn)(void* ctx, uint64_t offset, char const* data, uint32_t length);
+
+int  journal_open   (journal* j, char const* filename);
+void journal_begin  (journal* j);
+void journal_add    (journal* j, uint64_t offset, void const* data, uint32_t length);
+bool journal_end    (journal* j);
+void journal_sync   (journal const* j);
+int  journal_replay (journal* j, journal_apply_fn apply, void* ctx);
+void journal_reset  (journal* j);
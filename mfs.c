@@ -1,24 +1,119 @@
 #include <netinet/in.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <time.h>
 #include "mfs.h"
 #include "udp.h"
 
 char server_name[100] = {0};
 int server_port = -1;
 int const client_port = 12345;
-MFS_ClientToServer request = {0};
-MFS_ServerToClient response = {0};
+static MFS_Reply reply; // receive buffer, each reply's data is copied on to its request's destination
+static uint32_t session_id = 0;
+static uint32_t next_request_id = 1;
+
+typedef enum { SLOT_FREE, SLOT_SENT, SLOT_DONE } slot_state;
+
+// a request in the window, from when it is sent until its result is collected
+typedef struct slot_ {
+    slot_state state;
+    MFS_Request request;
+    size_t length;      // bytes of request.data
+    long long sent_at;  // first transmission
+    long long deadline; // when to resend it if there is still no reply
+    int retries;
+    char* dest;         // receives the reply's data (a Read's buffer, an MFS_Stat_t), NULL to drop it
+    size_t dest_size;
+    int return_val;
+    uint64_t version;   // of the reply
+    int reply_length;   // data bytes in the reply
+} slot;
+
+static slot slots[MFS_WINDOW_MAX];
+static int window = MFS_WINDOW_DEFAULT;
+static int in_flight = 0; // slots in SLOT_SENT
+
+// retransmission timeout estimated from round trip times (Jacobson/Karels, as in RFC 6298), usec
+static struct {
+    long long srtt;
+    long long rttvar;
+    long long rto;
+    long long min, max;
+} rto;
+static MFS_Stats stats;
+
+// LRU cache of blocks read with MFS_Read, keyed on (inum, block); a block is only served while its inode still
+// has the version it had when the block was read, which a lease lets the client assume for lease_usec
+typedef struct cached_block_ {
+    int inum;           // -1 = unused
+    int block;
+    uint64_t version;
+    int length;         // a directory block only holds its entries
+    int hash_next;      // next entry in the same bucket, -1 = none
+    int lru_prev;       // towards the most recently used, -1 = head
+    int lru_next;
+    char data[MFS_BLOCK_SIZE];
+} cached_block;
+
+// the version an inode had when the client last asked, assumed current until expires
+typedef struct inode_lease_ {
+    int inum;           // -1 = none
+    uint64_t version;
+    long long expires;
+} inode_lease;
+
+static struct {
+    int size;           // blocks, 0 = no cache
+    long long lease_usec;
+    cached_block* blocks;
+    int* buckets;       // size_mask + 1 chains of blocks
+    int size_mask;
+    int lru_head, lru_tail;
+    inode_lease* leases; // size of them, direct-mapped on inum
+} cache;
+
+// a Lookup's (or a LookupPath's) answer, inum -1 when the name doesn't exist
+typedef struct cached_name_ {
+    int pinum;          // -1 = unused
+    int inum;
+    long long expires;
+    uint32_t namespace; // a path is only good while it is meta.namespace, see forget_changes()
+    char name[252];     // or a path; longer ones aren't cached
+} cached_name;
+
+typedef struct cached_stat_ {
+    int inum;           // -1 = unused
+    long long expires;
+    MFS_Stat_t stat;
+} cached_stat;
+
+// Lookup and Stat results, direct-mapped on (pinum, name) and inum, each served for ttl_usec after it was asked for
+static struct {
+    int size;           // entries of each table, 0 = no metadata cache
+    long long ttl_usec;
+    uint32_t changes;   // the client's own mutations completed so far
+    uint32_t namespace; // of them, Creats and Unlinks
+    cached_name* names;
+    cached_stat* stats;
+} meta;
 
 // UDP stuff
 int fd = -1;
 struct sockaddr_in addr, addr2;
 
-static int wait_timeout() {
+static long long now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int wait_timeout(long long timeout_usec) {
     fd_set readfds;
     struct timeval timeout;
-    timeout.tv_sec =5; timeout.tv_usec = 0;
+    timeout.tv_sec = timeout_usec / 1000000; timeout.tv_usec = timeout_usec % 1000000;
 
     FD_ZERO(&readfds);
     FD_SET(fd, &readfds);
@@ -28,15 +123,491 @@ static int wait_timeout() {
     return ready;
 }
 
+static void send_slot(slot* s) {
+    int writebytes = UDP_Write(fd, &addr, (char*)&s->request, MFS_REQUEST_HEADER_SIZE + s->length); //write message to server@specified-port
+    printf("CLIENT:: sent (op %d) message (%d)\n", s->request.hdr.opcode, writebytes);
+    long long now = now_usec();
+    if (s->retries == 0)
+        s->sent_at = now;
+    // exponential backoff: every retransmission doubles the request's timeout, up to the ceiling
+    long long timeout = rto.rto;
+    for (int i = 0; i < s->retries && timeout < rto.max; i++)
+        timeout *= 2;
+    s->deadline = now + (timeout < rto.max ? timeout : rto.max);
+}
+
+static void update_rto(long long rtt) {
+    if (stats.srtt_usec == 0) {
+        rto.srtt = rtt;
+        rto.rttvar = rtt / 2;
+    } else {
+        long long error = rto.srtt > rtt ? rto.srtt - rtt : rtt - rto.srtt;
+        rto.rttvar = (3 * rto.rttvar + error) / 4;
+        rto.srtt = (7 * rto.srtt + rtt) / 8;
+    }
+    rto.rto = rto.srtt + 4 * rto.rttvar;
+    rto.rto = rto.rto < rto.min ? rto.min : rto.rto > rto.max ? rto.max : rto.rto;
+    stats.srtt_usec = rto.srtt > 0 ? rto.srtt : 1;
+    stats.rttvar_usec = rto.rttvar;
+    stats.rto_usec = rto.rto;
+}
+
+static slot* find_slot(int id) {
+    for (int i = 0; i < MFS_WINDOW_MAX; i++) {
+        if (slots[i].state != SLOT_FREE && slots[i].request.hdr.request_id == id)
+            return &slots[i];
+    }
+    return NULL;
+}
+
+static void forget_changes(MFS_Request const* request);
+
+// hand the reply in `reply` to the request it answers; garbled replies and stale ones (to a request
+// that was already answered, e.g. the second reply to a retransmission) are dropped
+static void receive_reply(int readbytes) {
+    if (readbytes < (int)MFS_REPLY_HEADER_SIZE || readbytes != MFS_REPLY_HEADER_SIZE + reply.hdr.length)
+        return;
+    slot* s = find_slot(reply.hdr.request_id);
+    if (s == NULL || s->state != SLOT_SENT || reply.hdr.session_id != session_id)
+        return;
+    printf("CLIENT:: read %d bytes\n", readbytes);
+    // Karn: a retransmitted request's reply may answer any of its copies, so it says nothing about the RTT
+    if (s->retries == 0)
+        update_rto(now_usec() - s->sent_at);
+    // a directory block only carries its entries, the rest of a Read's buffer is left as it was
+    if (s->dest != NULL)
+        memcpy(s->dest, reply.data, reply.hdr.length < s->dest_size ? reply.hdr.length : s->dest_size);
+    s->return_val = reply.return_val;
+    s->version = reply.version;
+    s->reply_length = reply.hdr.length;
+    s->state = SLOT_DONE;
+    --in_flight;
+    forget_changes(&s->request);
+}
+
+/*
+Wait up to timeout_usec for replies (0 = only take the ones already queued), then receive every queued reply and
+resend each request whose own deadline has passed. Never sleeps past the first deadline.
+*/
+static void pump(long long timeout_usec) {
+    long long now = now_usec();
+    for (int i = 0; i < MFS_WINDOW_MAX; i++) {
+        if (slots[i].state == SLOT_SENT && slots[i].deadline - now < timeout_usec)
+            timeout_usec = slots[i].deadline > now ? slots[i].deadline - now : 0;
+    }
+    for (int ready = wait_timeout(timeout_usec); ready > 0; ready = wait_timeout(0))
+        receive_reply(UDP_Read(fd, &addr2, (char*)&reply, sizeof reply)); //read message from ...
+
+    now = now_usec();
+    for (int i = 0; i < MFS_WINDOW_MAX; i++) {
+        if (slots[i].state == SLOT_SENT && slots[i].deadline <= now) {
+            printf("CLIENT:: no reply after %lld usec, trying again...\n", now - slots[i].sent_at);
+            ++slots[i].retries;
+            ++stats.retransmissions;
+            send_slot(&slots[i]);
+        }
+    }
+}
+
+/*
+Send a request carrying length bytes of data, first waiting for room in the window. The reply's data is copied
+to dest (at most dest_size bytes) when it arrives.
+Returns the request's id, -1 if the data is too long or every slot holds a result that hasn't been collected.
+*/
+static int submit(int opcode, int inum, int arg, int count, void const* data, size_t length, char* dest, size_t dest_size) {
+    if (length > MFS_DATA_MAX)
+        return -1;
+    while (in_flight >= window)
+        pump(rto.max);
+    slot* s = NULL;
+    for (int i = 0; i < MFS_WINDOW_MAX && s == NULL; i++) {
+        if (slots[i].state == SLOT_FREE)
+            s = &slots[i];
+    }
+    if (s == NULL) {
+        printf("CLIENT:: %d requests are done but not collected with MFS_Poll/MFS_Wait\n", MFS_WINDOW_MAX);
+        return -1;
+    }
+    int id = next_request_id;
+    next_request_id = next_request_id % INT32_MAX + 1; // ids stay positive
+    s->request.hdr.version = MFS_PROTOCOL_VERSION;
+    s->request.hdr.opcode = opcode;
+    s->request.hdr.length = length;
+    s->request.hdr.session_id = session_id;
+    s->request.hdr.request_id = id;
+    s->request.inum = inum;
+    s->request.arg = arg;
+    s->request.count = count;
+    memcpy(s->request.data, data, length);
+    s->length = length;
+    s->dest = dest;
+    s->dest_size = dest_size;
+    s->retries = 0;
+    s->state = SLOT_SENT;
+    ++in_flight;
+    ++stats.requests;
+    send_slot(s);
+    return id;
+}
+
+// free a finished request's slot, returning its result
+static int collect(slot* s) {
+    s->state = SLOT_FREE;
+    return s->return_val;
+}
+
+// MFS_Wait(), also handing back the reply's inode version and data length when asked
+static int wait_reply(int id, uint64_t* version, int* reply_length) {
+    slot* s = find_slot(id);
+    if (s == NULL)
+        return -1;
+    while (s->state == SLOT_SENT)
+        pump(rto.max);
+    if (version != NULL)
+        *version = s->version;
+    if (reply_length != NULL)
+        *reply_length = s->reply_length;
+    return collect(s);
+}
+
+// send a request and wait for its reply, resending it after every timeout; returns the reply's return_val
+static int send_request(int opcode, int inum, int arg, void const* data, size_t length, void* dest, size_t dest_size) {
+    int id = submit(opcode, inum, arg, 0, data, length, dest, dest_size);
+    return id < 0 ? -1 : MFS_Wait(id);
+}
+
+static int cache_bucket(int inum, int block) {
+    return (int)(((uint32_t)inum * 2654435761u + (uint32_t)block) & cache.size_mask);
+}
+
+static int cache_find(int inum, int block) {
+    for (int i = cache.buckets[cache_bucket(inum, block)]; i >= 0; i = cache.blocks[i].hash_next) {
+        if (cache.blocks[i].inum == inum && cache.blocks[i].block == block)
+            return i;
+    }
+    return -1;
+}
+
+static void lru_unlink(int i) {
+    cached_block* c = &cache.blocks[i];
+    if (c->lru_prev >= 0) cache.blocks[c->lru_prev].lru_next = c->lru_next; else cache.lru_head = c->lru_next;
+    if (c->lru_next >= 0) cache.blocks[c->lru_next].lru_prev = c->lru_prev; else cache.lru_tail = c->lru_prev;
+}
+
+static void lru_push_head(int i) {
+    cached_block* c = &cache.blocks[i];
+    c->lru_prev = -1;
+    c->lru_next = cache.lru_head;
+    if (cache.lru_head >= 0) cache.blocks[cache.lru_head].lru_prev = i; else cache.lru_tail = i;
+    cache.lru_head = i;
+}
+
+// take block i out of its bucket, leaving it unused at the cold end of the LRU list
+static void cache_drop(int i) {
+    cached_block* c = &cache.blocks[i];
+    int* link = &cache.buckets[cache_bucket(c->inum, c->block)];
+    while (*link != i)
+        link = &cache.blocks[*link].hash_next;
+    *link = c->hash_next;
+    c->inum = -1;
+    lru_unlink(i);
+    // append at the tail, the next one to be reused
+    c->lru_next = -1;
+    c->lru_prev = cache.lru_tail;
+    if (cache.lru_tail >= 0) cache.blocks[cache.lru_tail].lru_next = i; else cache.lru_head = i;
+    cache.lru_tail = i;
+}
+
+static void cache_insert(int inum, int block, uint64_t version, char const* data, int length) {
+    int i = cache_find(inum, block);
+    if (i < 0) {
+        // reuse the least recently used block
+        i = cache.lru_tail;
+        if (cache.blocks[i].inum >= 0)
+            cache_drop(i);
+        cached_block* c = &cache.blocks[i];
+        c->inum = inum;
+        c->block = block;
+        int bucket = cache_bucket(inum, block);
+        c->hash_next = cache.buckets[bucket];
+        cache.buckets[bucket] = i;
+    }
+    cached_block* c = &cache.blocks[i];
+    c->version = version;
+    c->length = length;
+    memcpy(c->data, data, length);
+    lru_unlink(i);
+    lru_push_head(i);
+}
+
+static inode_lease* lease_of(int inum) {
+    return &cache.leases[(unsigned)inum % cache.size];
+}
+
+// the inode had version when a request sent at sent_at was answered
+static void renew_lease(int inum, uint64_t version, long long sent_at) {
+    *lease_of(inum) = (inode_lease){ .inum = inum, .version = version, .expires = sent_at + cache.lease_usec };
+}
+
+// our own mutation changes inum: check its version before serving any of its blocks again
+static void expire_lease(int inum) {
+    if (cache.size > 0 && lease_of(inum)->inum == inum)
+        lease_of(inum)->inum = -1;
+}
+
+/*
+Copy block of inum from the cache into buffer if it is there and the inode hasn't changed since it was read.
+Outside the lease that takes a Stat round trip, which is still cheaper than reading the block.
+*/
+static bool cached_read(int inum, char* buffer, int block) {
+    int i = cache_find(inum, block);
+    if (i < 0)
+        return false;
+    inode_lease* lease = lease_of(inum);
+    if (lease->inum != inum || lease->expires <= now_usec()) {
+        MFS_Stat_t m;
+        uint64_t version;
+        long long sent_at = now_usec();
+        int id = submit(MFS_OP_STAT, inum, 0, 0, NULL, 0, (char*)&m, sizeof m);
+        ++stats.revalidations;
+        if (id < 0 || wait_reply(id, &version, NULL) < 0) {
+            cache_drop(i);
+            return false;
+        }
+        renew_lease(inum, version, sent_at);
+    }
+    cached_block* c = &cache.blocks[i];
+    if (c->version != lease->version) {
+        cache_drop(i);
+        return false;
+    }
+    memcpy(buffer, c->data, c->length);
+    lru_unlink(i);
+    lru_push_head(i);
+    ++stats.cache_hits;
+    return true;
+}
+
+static void free_cache() {
+    free(cache.blocks);
+    free(cache.buckets);
+    free(cache.leases);
+    memset(&cache, 0, sizeof cache);
+}
+
+static void init_cache(int size, long long lease_usec) {
+    free_cache();
+    if (size == 0)
+        return;
+    cache.size = size;
+    cache.lease_usec = lease_usec;
+    for (cache.size_mask = 1; cache.size_mask < size; cache.size_mask *= 2)
+        ;
+    cache.blocks = malloc(size * sizeof *cache.blocks);
+    cache.buckets = malloc(cache.size_mask * sizeof *cache.buckets);
+    cache.leases = malloc(size * sizeof *cache.leases);
+    assert(cache.blocks != NULL && cache.buckets != NULL && cache.leases != NULL);
+    --cache.size_mask;
+    for (int i = 0; i <= cache.size_mask; i++)
+        cache.buckets[i] = -1;
+    for (int i = 0; i < size; i++) {
+        cache.blocks[i] = (cached_block){ .inum = -1, .hash_next = -1, .lru_prev = i - 1, .lru_next = i + 1 < size ? i + 1 : -1 };
+        cache.leases[i].inum = -1;
+    }
+    cache.lru_head = 0;
+    cache.lru_tail = size - 1;
+}
+
+static cached_name* name_slot(int pinum, char const* name) {
+    uint32_t hash = 2166136261u ^ (uint32_t)pinum; // FNV-1a
+    for (char const* c = name; *c != '\0'; c++)
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    return &meta.names[hash % meta.size];
+}
+
+// the cached answer to looking up name (a path if it has a '/') in pinum, NULL if there is none still good
+static cached_name* find_name(int pinum, char const* name) {
+    if (meta.size == 0)
+        return NULL;
+    cached_name* n = name_slot(pinum, name);
+    if (n->pinum != pinum || strcmp(n->name, name) != 0 || n->expires <= now_usec())
+        return NULL;
+    if (strchr(name, '/') != NULL && n->namespace != meta.namespace)
+        return NULL;
+    return n;
+}
+
+/*
+Remember the answer to a lookup sent at sent_at, unless one of our own mutations completed while it was in flight
+(changes and namespace are what meta's counters were when it was sent): the answer may predate it.
+*/
+static void put_name(int pinum, char const* name, int inum, long long sent_at, uint32_t changes, uint32_t namespace) {
+    if (meta.size == 0 || changes != meta.changes || strlen(name) >= sizeof meta.names[0].name)
+        return;
+    cached_name* n = name_slot(pinum, name);
+    n->pinum = pinum;
+    n->inum = inum;
+    n->expires = sent_at + meta.ttl_usec;
+    n->namespace = namespace;
+    strcpy(n->name, name);
+}
+
+static cached_stat* find_stat(int inum) {
+    if (meta.size == 0)
+        return NULL;
+    cached_stat* c = &meta.stats[(unsigned)inum % meta.size];
+    return c->inum == inum && c->expires > now_usec() ? c : NULL;
+}
+
+static void put_stat(int inum, MFS_Stat_t const* m, long long sent_at, uint32_t changes) {
+    if (meta.size == 0 || changes != meta.changes)
+        return;
+    meta.stats[(unsigned)inum % meta.size] = (cached_stat){ .inum = inum, .expires = sent_at + meta.ttl_usec, .stat = *m };
+}
+
+static void drop_stat(int inum) {
+    cached_stat* c = find_stat(inum);
+    if (c != NULL)
+        c->inum = -1;
+}
+
+/*
+One of our own requests completed, forget what it may have changed: a Write changes its inode's size, a Creat or
+Unlink the entry's name and its directory's size (and an Unlink drops the inode named). Path results go stale on
+any Creat or Unlink, since which components they went through isn't kept.
+*/
+static void forget_changes(MFS_Request const* request) {
+    uint8_t opcode = request->hdr.opcode;
+    if (opcode != MFS_OP_WRITE && opcode != MFS_OP_WRITE_RANGE && opcode != MFS_OP_WRITE_AT && opcode != MFS_OP_CREAT &&
+        opcode != MFS_OP_UNLINK)
+        return;
+    // the inode's version must be checked before any of its cached blocks is served again
+    expire_lease(request->inum);
+    if (meta.size == 0)
+        return;
+    ++meta.changes;
+    drop_stat(request->inum);
+    if (opcode == MFS_OP_CREAT || opcode == MFS_OP_UNLINK) {
+        ++meta.namespace;
+        cached_name* n = find_name(request->inum, request->data);
+        if (n != NULL) {
+            if (n->inum >= 0)
+                drop_stat(n->inum);
+            n->pinum = -1;
+        }
+    }
+}
+
+static void free_meta() {
+    free(meta.names);
+    free(meta.stats);
+    memset(&meta, 0, sizeof meta);
+}
+
+static void init_meta(int size, long long ttl_usec) {
+    free_meta();
+    if (size == 0)
+        return;
+    meta.size = size;
+    meta.ttl_usec = ttl_usec;
+    meta.names = malloc(size * sizeof *meta.names);
+    meta.stats = malloc(size * sizeof *meta.stats);
+    assert(meta.names != NULL && meta.stats != NULL);
+    for (int i = 0; i < size; i++) {
+        meta.names[i].pinum = -1;
+        meta.stats[i].inum = -1;
+    }
+}
+
+/*
+Move count units of unit bytes (blocks for the range calls, single bytes for ReadAt/WriteAt) from first on, in
+requests of up to MFS_DATA_MAX bytes, keeping the window full. Reads return the number of units read, which stops
+at the first request that comes back short; writes return 0 if every request succeeded. -1 on failure.
+*/
+static int send_range(int opcode, int inum, int first, int count, int unit, char* buffer) {
+    if (count < 0)
+        return -1;
+    bool writes = opcode == MFS_OP_WRITE_RANGE || opcode == MFS_OP_WRITE_AT;
+    int chunk_max = MFS_DATA_MAX / unit;
+    int ids[MFS_WINDOW_MAX];
+    int chunks = (count + chunk_max - 1) / chunk_max;
+    int rc = 0;
+    bool stopped = false;
+    for (int c = 0; c < chunks + window; c++) {
+        if (c >= window && c - window < chunks) {
+            // the oldest request is window chunks back, collect it to make room
+            int done = c - window;
+            int done_rc = MFS_Wait(ids[done % window]);
+            int done_count = count - done * chunk_max < chunk_max ? count - done * chunk_max : chunk_max;
+            if (writes) {
+                if (done_rc < 0)
+                    rc = -1;
+            } else if (!stopped) {
+                if (done_rc < 0 && done == 0)
+                    rc = -1;
+                else if (done_rc > 0)
+                    rc += done_rc;
+                stopped = done_rc < done_count;
+            }
+        }
+        if (c < chunks) {
+            int n = count - c * chunk_max < chunk_max ? count - c * chunk_max : chunk_max;
+            char* chunk = buffer + (size_t)c * chunk_max * unit;
+            size_t bytes = (size_t)n * unit;
+            ids[c % window] = writes ?
+                submit(opcode, inum, first + c * chunk_max, n, chunk, bytes, NULL, 0) :
+                submit(opcode, inum, first + c * chunk_max, n, NULL, 0, chunk, bytes);
+        }
+    }
+    return rc;
+}
+
 /*
 MFS_Init() takes a host name and port number and uses those to find the server exporting the file system.
 */
 int MFS_Init(char *hostname, int port) {
+    return MFS_InitWithOptions(hostname, port, NULL);
+}
+
+/*
+MFS_InitWithOptions() is MFS_Init() with the settings in options (NULL = the defaults).
+Returns 0 on success, -1 if an option is out of range.
+*/
+int MFS_InitWithOptions(char *hostname, int port, MFS_Options const *options) {
+    MFS_Options defaults = {0};
+    if (options == NULL)
+        options = &defaults;
+    if (options->window < 0 || options->window > MFS_WINDOW_MAX)
+        return -1;
+    window = options->window == 0 ? MFS_WINDOW_DEFAULT : options->window;
+    rto.min = options->rto_min_usec == 0 ? MFS_RTO_MIN_DEFAULT : options->rto_min_usec;
+    rto.max = options->rto_max_usec == 0 ? MFS_RTO_MAX_DEFAULT : options->rto_max_usec;
+    rto.rto = options->rto_initial_usec == 0 ? MFS_RTO_INITIAL_DEFAULT : options->rto_initial_usec;
+    if (rto.min <= 0 || rto.min > rto.max || rto.rto <= 0)
+        return -1;
+    rto.rto = rto.rto < rto.min ? rto.min : rto.rto > rto.max ? rto.max : rto.rto;
+    if (options->cache_blocks < 0 || options->lease_usec < 0)
+        return -1;
+    init_cache(options->cache_blocks, options->lease_usec);
+    if (options->meta_entries < 0 || options->meta_ttl_usec < 0)
+        return -1;
+    init_meta(options->meta_entries, options->meta_ttl_usec);
+    memset(&stats, 0, sizeof stats);
+    stats.rto_usec = rto.rto;
+
     strcpy(server_name, hostname);
     server_port = port;
+    // the server remembers the results of our mutations by (session, request id), so a retransmission is not
+    // executed twice; a new session keeps ids that restart at 1 from matching an earlier client's
+    session_id = (uint32_t)now_usec() ^ (uint32_t)getpid() << 16;
+    if (session_id == 0)
+        session_id = 1;
+    next_request_id = 1;
 
     fd = UDP_Open(client_port); //communicate through specified port 
     assert(fd > -1);
+    // room for a full window of block replies, a kernel buffer charges about twice a datagram's size
+    UDP_SetBufferSize(fd, window * 2 * sizeof(MFS_Reply));
 
     int rc = UDP_FillSockAddr(&addr, server_name, server_port); //contact server at specified port
     assert(rc == 0);
@@ -44,60 +615,119 @@ int MFS_Init(char *hostname, int port) {
     return 0;
 }
 
+/*
+MFS_GetStats() fills in the client's request counters and its current round trip time estimate.
+*/
+void MFS_GetStats(MFS_Stats *stats_out) {
+    *stats_out = stats;
+}
+
+/*
+MFS_ReadAsync() sends the request of MFS_Read() and returns its id without waiting for the reply; buffer is filled
+when the reply arrives, so it must not be reused until MFS_Poll()/MFS_Wait() reports the request done.
+Success: the request's id (> 0); failure: -1 (nothing was sent).
+*/
+int MFS_ReadAsync(int inum, char *buffer, int block) {
+    return submit(MFS_OP_READ, inum, block, 0, NULL, 0, buffer, MFS_BLOCK_SIZE);
+}
+
+/*
+MFS_WriteAsync() sends the request of MFS_Write() and returns its id without waiting for the reply. buffer is
+copied before it returns. Success: the request's id (> 0); failure: -1 (nothing was sent).
+*/
+int MFS_WriteAsync(int inum, char *buffer, int block) {
+    return submit(MFS_OP_WRITE, inum, block, 0, buffer, MFS_BLOCK_SIZE, NULL, 0);
+}
+
+/*
+MFS_Poll() takes whatever replies have arrived, without blocking, and checks on request id. Once it reports the
+request done (returns 1 and stores its return value in *rc) the id is retired.
+Returns 1 when done, 0 while still in flight, -1 if id is not a request in flight or waiting to be collected.
+*/
+int MFS_Poll(int id, int *rc) {
+    slot* s = find_slot(id);
+    if (s == NULL)
+        return -1;
+    if (s->state == SLOT_SENT)
+        pump(0);
+    if (s->state == SLOT_SENT)
+        return 0;
+    *rc = collect(s);
+    return 1;
+}
+
+/*
+MFS_Wait() blocks until request id is done and retires it, retransmitting it (and the others in flight) as needed.
+Returns the request's return value, as the blocking call would have; -1 if id is unknown.
+*/
+int MFS_Wait(int id) {
+    return wait_reply(id, NULL, NULL);
+}
+
 /*
 MFS_Lookup() takes the parent inode number (which should be the inode number of a directory) and looks up the entry name in it.
 The inode number of name is returned. Success: return inode number of name; failure: return -1. Failure modes: invalid pinum, name does not exist in pinum.
+With a metadata cache (MFS_Options.meta_entries) a recent answer, including a failure, is given again without asking.
 */
 int MFS_Lookup(int pinum, char *name) {
-    memset(&request, 0, sizeof request);
-    memset(&response, 0, sizeof response);
-    strcpy(request.cmd, "MFS_Lookup");
-    request.inum = pinum;
-    strcpy(request.filename, name);
-
-    int ready = -1;
-    while (ready<1) {
-        int writebytes = UDP_Write(fd, &addr, (char*)&request, sizeof request); //write message to server@specified-port
-        printf("CLIENT:: sent (%s) message (%d)\n", request.cmd, writebytes);
-
-        ready = wait_timeout();
-        if (ready < 1) {
-            printf("5 second timeout, trying again...\n");
-            continue;
-        }
+    cached_name* n = find_name(pinum, name);
+    if (n != NULL) {
+        ++stats.meta_hits;
+        return n->inum;
     }
+    uint32_t changes = meta.changes, namespace = meta.namespace;
+    long long sent_at = now_usec();
+    int rc = send_request(MFS_OP_LOOKUP, pinum, 0, name, strlen(name) + 1, NULL, 0);
+    put_name(pinum, name, rc, sent_at, changes, namespace);
+    return rc;
+}
 
-    int readbytes = UDP_Read(fd, &addr2, (char*)&response, sizeof response); //read message from ...
-	printf("CLIENT:: read %d bytes (message: '%s')\n", readbytes, response.buffer);
-    return response.return_val;
+/*
+MFS_LookupPath() resolves a '/' separated path relative to the directory pinum in a single round trip, instead of one
+MFS_Lookup() per component. Empty components are skipped. If m is not NULL it receives the MFS_Stat_t of the final inode.
+Success: return inode number at the end of path; failure: return -1. Failure modes: invalid pinum, a component does not exist or is not a directory.
+With a metadata cache a recent answer for the same pinum and path is given again without asking.
+*/
+int MFS_LookupPath(int pinum, char *path, MFS_Stat_t *m) {
+    MFS_Stat_t stat = {0}; // left zeroed if the server rejects the request before filling it in
+    cached_name* n = find_name(pinum, path);
+    cached_stat* c = n != NULL && n->inum >= 0 && m != NULL ? find_stat(n->inum) : NULL;
+    if (n != NULL && (m == NULL || n->inum < 0 || c != NULL)) {
+        if (m != NULL)
+            *m = c != NULL ? c->stat : stat;
+        ++stats.meta_hits;
+        return n->inum;
+    }
+    uint32_t changes = meta.changes, namespace = meta.namespace;
+    long long sent_at = now_usec();
+    int rc = send_request(MFS_OP_LOOKUP_PATH, pinum, 0, path, strlen(path) + 1, &stat, sizeof stat);
+    put_name(pinum, path, rc, sent_at, changes, namespace);
+    if (rc >= 0)
+        put_stat(rc, &stat, sent_at, changes);
+    if (m != NULL)
+        *m = stat;
+    return rc;
 }
 
 /*
 MFS_Stat() returns some information about the file specified by inum. Upon success, return 0, otherwise -1.
 The exact info returned is defined by MFS_Stat_t. Failure modes: inum does not exist.
+With a metadata cache a recent successful answer is given again without asking.
 */
 int MFS_Stat(int inum, MFS_Stat_t *m) {
-    memset(&request, 0, sizeof request);
-    memset(&response, 0, sizeof response);
-    strcpy(request.cmd, "MFS_Stat");
-    request.inum = inum;
-
-    int ready = -1;
-    while (ready<1) {
-        int writebytes = UDP_Write(fd, &addr, (char*)&request, sizeof request); //write message to server@specified-port
-        printf("CLIENT:: sent (%s) message (%d)\n", request.cmd, writebytes);
-
-        ready = wait_timeout();
-        if (ready < 1) {
-            printf("5 second timeout, trying again...\n");
-            continue;
-        }
+    cached_stat* c = find_stat(inum);
+    if (c != NULL) {
+        *m = c->stat;
+        ++stats.meta_hits;
+        return 0;
     }
-
-    int readbytes = UDP_Read(fd, &addr2, (char*)&response, sizeof response); //read message from ...
-	printf("CLIENT:: read %d bytes (message: '%s')\n", readbytes, response.buffer);
-    memcpy(m, &response.stat, sizeof *m);
-    return response.return_val;
+    memset(m, 0, sizeof *m);
+    uint32_t changes = meta.changes;
+    long long sent_at = now_usec();
+    int rc = send_request(MFS_OP_STAT, inum, 0, NULL, 0, m, sizeof *m);
+    if (rc == 0)
+        put_stat(inum, m, sent_at, changes);
+    return rc;
 }
 
 /*
@@ -105,59 +735,30 @@ MFS_Write() writes a block of size 4096 bytes at the block offset specified by b
 Failure modes: invalid inum, invalid block, not a regular file (you can't write to directories).
 */
 int MFS_Write(int inum, char *buffer, int block) {
-    memset(&request, 0, sizeof request);
-    memset(&response, 0, sizeof response);
-    strcpy(request.cmd, "MFS_Write");
-    request.inum = inum;
-    request.block = block;
-    memcpy(request.buffer, buffer, MFS_BLOCK_SIZE);
-
-    int ready = -1;
-    while (ready<1) {
-        int writebytes = UDP_Write(fd, &addr, (char*)&request, sizeof request); //write message to server@specified-port
-        printf("CLIENT:: sent (%s) message (%d)\n", request.cmd, writebytes);
-
-        ready = wait_timeout();
-        if (ready < 1) {
-            printf("5 second timeout, trying again...\n");
-            continue;
-        }
-    }
-
-    int readbytes = UDP_Read(fd, &addr2, (char*)&response, sizeof response); //read message from ...
-	printf("CLIENT:: read %d bytes (message: '%s')\n", readbytes, response.buffer);
-    return response.return_val;
+    return send_request(MFS_OP_WRITE, inum, block, buffer, MFS_BLOCK_SIZE, NULL, 0);
 }
 
 /*
 MFS_Read() reads a block specified by block into the buffer from file specified by inum .
 The routine should work for either a file or directory; directories should return data in the format specified by MFS_DirEnt_t.
+With a block cache (MFS_Options.cache_blocks) a block whose inode hasn't changed since it was read is served locally.
 Success: 0, failure: -1. Failure modes: invalid inum, invalid block.
 */
 int MFS_Read(int inum, char *buffer, int block) {
-    memset(&request, 0, sizeof request);
-    memset(&response, 0, sizeof response);
-    strcpy(request.cmd, "MFS_Read");
-    request.inum = inum;
-    request.block = block;
-    memcpy(request.buffer, buffer, MFS_BLOCK_SIZE);
-
-    int ready = -1;
-    while (ready<1) {
-        int writebytes = UDP_Write(fd, &addr, (char*)&request, sizeof request); //write message to server@specified-port
-        printf("CLIENT:: sent (%s) message (%d)\n", request.cmd, writebytes);
-
-        ready = wait_timeout();
-        if (ready < 1) {
-            printf("5 second timeout, trying again...\n");
-            continue;
-        }
+    if (cache.size == 0)
+        return send_request(MFS_OP_READ, inum, block, NULL, 0, buffer, MFS_BLOCK_SIZE);
+    if (cached_read(inum, buffer, block))
+        return 0;
+    uint64_t version;
+    int length;
+    long long sent_at = now_usec();
+    int id = submit(MFS_OP_READ, inum, block, 0, NULL, 0, buffer, MFS_BLOCK_SIZE);
+    int rc = id < 0 ? -1 : wait_reply(id, &version, &length);
+    if (rc == 0) {
+        cache_insert(inum, block, version, buffer, length);
+        renew_lease(inum, version, sent_at);
     }
-
-    int readbytes = UDP_Read(fd, &addr2, (char*)&response, sizeof response); //read message from ...
-    memcpy(buffer, response.buffer, MFS_BLOCK_SIZE);
-	printf("CLIENT:: read %d bytes (message: '%s')\n", readbytes, response.buffer);
-    return response.return_val;
+    return rc;
 }
 
 /*
@@ -165,28 +766,7 @@ MFS_Creat() makes a file ( type == MFS_REGULAR_FILE) or directory ( type == MFS_
 Returns 0 on success, -1 on failure. Failure modes: pinum does not exist. If name already exists, return success (think about why).
 */
 int MFS_Creat(int pinum, int type, char *name) {
-    memset(&request, 0, sizeof request);
-    memset(&response, 0, sizeof response);
-    strcpy(request.cmd, "MFS_Creat");
-    request.inum = pinum;
-    request.filetype = type;
-    strcpy(request.filename, name);
-
-    int ready = -1;
-    while (ready<1) {
-        int writebytes = UDP_Write(fd, &addr, (char*)&request, sizeof request); //write message to server@specified-port
-        printf("CLIENT:: sent (%s) message (%d)\n", request.cmd, writebytes);
-
-        ready = wait_timeout();
-        if (ready < 1) {
-            printf("5 second timeout, trying again...\n");
-            continue;
-        }
-    }
-
-    int readbytes = UDP_Read(fd, &addr2, (char*)&response, sizeof response); //read message from ...
-	printf("CLIENT:: read %d bytes\n", readbytes);
-    return response.return_val;
+    return send_request(MFS_OP_CREAT, pinum, type, name, strlen(name) + 1, NULL, 0);
 }
 
 
@@ -196,25 +776,69 @@ MFS_Unlink() removes the file or directory name from the directory specified by
 Note that the name not existing is NOT a failure by our definition (think about why this might be).
 */
 int MFS_Unlink(int pinum, char *name) {
-    memset(&request, 0, sizeof request);
-    memset(&response, 0, sizeof response);
-    strcpy(request.cmd, "MFS_Unlink");
-    request.inum = pinum;
-    strcpy(request.filename, name);
-
-    int ready = -1;
-    while (ready<1) {
-        int writebytes = UDP_Write(fd, &addr, (char*)&request, sizeof request); //write message to server@specified-port
-        printf("CLIENT:: sent (%s) message (%d)\n", request.cmd, writebytes);
-
-        ready = wait_timeout();
-        if (ready < 1) {
-            printf("5 second timeout, trying again...\n");
-            continue;
-        }
-    }
+    return send_request(MFS_OP_UNLINK, pinum, 0, name, strlen(name) + 1, NULL, 0);
+}
 
-    int readbytes = UDP_Read(fd, &addr2, (char*)&response, sizeof response); //read message from ...
-	printf("CLIENT:: read %d bytes (message: '%s')\n", readbytes, response.buffer);
-    return response.return_val;
+int MFS_Grow(int zones) {
+    return send_request(MFS_OP_GROW, 0, zones, NULL, 0, NULL, 0);
+}
+
+/*
+MFS_ReadRange() reads nblocks blocks starting at first_block of inum into buffer, which must hold nblocks blocks,
+with one request per MFS_RANGE_BLOCKS_MAX blocks instead of one per block. A directory block's part past its
+entries is zeroed. Success: the number of blocks read, fewer than nblocks if the range runs past the end of the
+file; failure: -1. Failure modes: invalid inum, first_block is not a block of the file.
+*/
+int MFS_ReadRange(int inum, int first_block, int nblocks, char *buffer) {
+    return send_range(MFS_OP_READ_RANGE, inum, first_block, nblocks, MFS_BLOCK_SIZE, buffer);
+}
+
+/*
+MFS_WriteRange() writes nblocks blocks from buffer to inum starting at first_block, with one request per
+MFS_RANGE_BLOCKS_MAX blocks instead of one per block; the server makes each request durable in one step.
+Returns 0 on success, -1 on failure (blocks before the one that failed may have been written).
+Failure modes: as for MFS_Write() for any block of the range.
+*/
+int MFS_WriteRange(int inum, int first_block, int nblocks, char *buffer) {
+    return send_range(MFS_OP_WRITE_RANGE, inum, first_block, nblocks, MFS_BLOCK_SIZE, buffer);
+}
+
+/*
+MFS_ReadAt() reads nbytes of regular file inum from byte offset on into buffer, one request per MFS_DATA_MAX bytes
+carrying only those bytes. Success: the number of bytes read, fewer than nbytes if the file ends first (0 from
+its end on); failure: -1. Failure modes: invalid inum, not a regular file, negative offset or nbytes.
+*/
+int MFS_ReadAt(int inum, char *buffer, int offset, int nbytes) {
+    return send_range(MFS_OP_READ_AT, inum, offset, nbytes, 1, buffer);
+}
+
+/*
+MFS_WriteAt() writes nbytes from buffer to regular file inum at byte offset, one request per MFS_DATA_MAX bytes
+carrying only those bytes, so appending a small record costs a small datagram. Returns 0 on success, -1 on failure
+(bytes before the request that failed may have been written). Failure modes: invalid inum, not a regular file,
+the bytes don't fit in a file (MFS_BLOCK_SIZE << 18 bytes).
+*/
+int MFS_WriteAt(int inum, char *buffer, int offset, int nbytes) {
+    return send_range(MFS_OP_WRITE_AT, inum, offset, nbytes, 1, buffer);
+}
+
+/*
+MFS_ReadDir() lists directory inum from *cursor on, see mfs.h: one request fills buffer with up to nbytes of
+MFS_DirRecord_ts and moves *cursor on. Returns the bytes of records, 0 once *cursor is MFS_READDIR_END, -1 on
+failure. Failure modes: invalid inum, inum is not a directory, invalid cursor, nbytes too small for the next entry.
+*/
+int MFS_ReadDir(int inum, uint64_t *cursor, char *buffer, int nbytes, int flags) {
+    static char listing[MFS_DATA_MAX]; // next cursor, then the records
+    if (*cursor == MFS_READDIR_END)
+        return 0;
+    if (nbytes > (int)(MFS_DATA_MAX - sizeof *cursor))
+        nbytes = MFS_DATA_MAX - sizeof *cursor;
+    int reply_length;
+    int id = submit(MFS_OP_READDIR, inum, flags, nbytes, cursor, sizeof *cursor, listing, sizeof listing);
+    int rc = id < 0 ? -1 : wait_reply(id, NULL, &reply_length);
+    if (rc < 0 || reply_length != (int)sizeof *cursor + rc)
+        return -1;
+    memcpy(cursor, listing, sizeof *cursor);
+    memcpy(buffer, listing + sizeof *cursor, rc);
+    return rc;
 }
@@ -1,6 +1,9 @@
 #ifndef __MFS_h__
 #define __MFS_h__
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define MFS_DIRECTORY    (0)
 #define MFS_REGULAR_FILE (1)
 
@@ -21,25 +24,144 @@ typedef struct __MFS_DirEnt_t {
 
 int MFS_Init(char *hostname, int port);
 int MFS_Lookup(int pinum, char *name);
+int MFS_LookupPath(int pinum, char *path, MFS_Stat_t *m);
 int MFS_Stat(int inum, MFS_Stat_t *m);
 int MFS_Write(int inum, char *buffer, int block);
 int MFS_Read(int inum, char *buffer, int block);
 int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
+int MFS_ReadRange(int inum, int first_block, int nblocks, char *buffer);
+int MFS_WriteRange(int inum, int first_block, int nblocks, char *buffer);
+
+// Byte I/O on regular files: only the bytes asked for cross the network, so small records are appended without
+// shipping (or first reading) the blocks around them. MFS_WriteAt allocates just the blocks it writes to and sets
+// the size to offset + nbytes when that is past the end; MFS_ReadAt stops at the end and reads holes as zeros.
+int MFS_ReadAt(int inum, char *buffer, int offset, int nbytes);
+int MFS_WriteAt(int inum, char *buffer, int offset, int nbytes);
+
+// Directory listing. MFS_ReadDir packs the entries of directory inum from *cursor on into buffer as records of
+// this form, as many as fit in nbytes (one request, at most MFS_DATA_MAX - 8 bytes), and advances *cursor.
+// Start with *cursor = 0 and call again until it is MFS_READDIR_END; a cursor stays valid while the directory
+// changes (entries there throughout come back exactly once) and across server restarts.
+// Returns the bytes of records in buffer, -1 on failure (inum isn't a directory, nbytes can't hold an entry).
+#define MFS_READDIR_PLUS   (1)         // flag: fill in type and size
+#define MFS_READDIR_NOTYPE (0xff)
+#define MFS_READDIR_END    (1ull << 32)
+
+typedef struct __MFS_DirRecord_t {
+    int32_t  inum;
+    uint16_t reclen;  // bytes from this record to the next, records are 4-byte aligned
+    uint8_t  namelen; // without the '\0' that follows the name
+    uint8_t  type;    // MFS_DIRECTORY or MFS_REGULAR_FILE with MFS_READDIR_PLUS, MFS_READDIR_NOTYPE otherwise
+    int32_t  size;    // bytes with MFS_READDIR_PLUS, -1 otherwise
+    char     name[];
+} MFS_DirRecord_t;
+
+int MFS_ReadDir(int inum, uint64_t *cursor, char *buffer, int nbytes, int flags);
+
+#define MFS_WINDOW_DEFAULT (8)
+#define MFS_WINDOW_MAX     (64) // requests in flight plus completed ones not yet collected with MFS_Poll/MFS_Wait
+
+// retransmission timeout: starts at the initial value, then follows the measured round trip time (smoothed RTT
+// + 4 x its mean deviation), kept between the floor and the ceiling; each resend of a request doubles its timeout
+#define MFS_RTO_INITIAL_DEFAULT (1000000) // usec
+#define MFS_RTO_MIN_DEFAULT     (2000)
+#define MFS_RTO_MAX_DEFAULT     (5000000)
+
+typedef struct __MFS_Options {
+    int window;           // requests the client keeps in flight at once, 1..MFS_WINDOW_MAX (0 = MFS_WINDOW_DEFAULT)
+    int rto_initial_usec; // 0 = MFS_RTO_INITIAL_DEFAULT, and so on
+    int rto_min_usec;
+    int rto_max_usec;
+    int cache_blocks;     // blocks MFS_Read keeps (LRU), 0 = no cache
+    int lease_usec;       // a cached block is served without asking the server for this long after its inode's
+                          // version was last checked, 0 = check it (one Stat) on every hit; the client's own
+                          // mutations always end the lease, other clients' changes may go unseen until it ends
+    int meta_entries;     // Lookup/LookupPath results (negative ones too) and Stats kept, 0 = no metadata cache
+    int meta_ttl_usec;    // how long one of them is served without asking the server; the client's own Creat,
+                          // Unlink and Write drop what they change, other clients' changes may go unseen that long
+} MFS_Options;
+
+typedef struct __MFS_Stats {
+    long requests;        // sent, retransmissions not included
+    long retransmissions;
+    long srtt_usec;       // smoothed round trip time, 0 until the first reply
+    long rttvar_usec;     // its mean deviation
+    long rto_usec;        // timeout of the next request sent
+    long cache_hits;      // MFS_Read calls served from the block cache
+    long revalidations;   // Stat round trips made to check a cached block's inode version
+    long meta_hits;       // Lookup, LookupPath and Stat calls answered from the metadata cache
+} MFS_Stats;
+
+int MFS_InitWithOptions(char *hostname, int port, MFS_Options const *options);
+void MFS_GetStats(MFS_Stats *stats);
+
+// Administration: add zones (4096 inodes and 4096 blocks each) to the server's file system ahead of need, it
+// otherwise grows by itself as it fills up. Returns the number of zones it has (zones = 0 only asks), -1 on failure.
+int MFS_Grow(int zones);
+
+// Pipelined block I/O. Each call sends its request and returns its id (> 0) without waiting for the reply,
+// blocking only while the window is full; -1 if it can't be sent. Requests in flight may be executed in any order.
+// A Read fills buffer when it completes, so buffer must stay valid until then; a Write copies buffer right away.
+int MFS_ReadAsync(int inum, char *buffer, int block);
+int MFS_WriteAsync(int inum, char *buffer, int block);
+int MFS_Poll(int id, int *rc); // 1 = done, *rc = its return value; 0 = still in flight; -1 = unknown id
+int MFS_Wait(int id);          // blocks until done, returns its return value (-1 for an unknown id too)
+
+// Wire protocol. A datagram is a header, the fixed fields of the message and then `length` bytes of data,
+// so metadata requests and replies stay a few dozen bytes and only Read/Write carry a block.
+
+#define MFS_PROTOCOL_VERSION (4) // 1 = no session_id, 2 = no count, 3 = no version in replies
+
+#define MFS_RANGE_BLOCKS_MAX (15) // blocks in one ReadRange/WriteRange datagram, which must stay under 64 KB
+#define MFS_DATA_MAX         (MFS_RANGE_BLOCKS_MAX * MFS_BLOCK_SIZE)
+
+// opcodes index the server's dispatch table
+enum {
+    MFS_OP_LOOKUP,
+    MFS_OP_LOOKUP_PATH,
+    MFS_OP_STAT,
+    MFS_OP_WRITE,
+    MFS_OP_READ,
+    MFS_OP_CREAT,
+    MFS_OP_UNLINK,
+    MFS_OP_READ_RANGE,
+    MFS_OP_WRITE_RANGE,
+    MFS_OP_GROW,
+    MFS_OP_READDIR,
+    MFS_OP_READ_AT,
+    MFS_OP_WRITE_AT,
+    MFS_OP_COUNT
+};
+
+typedef struct __MFS_Header {
+    uint8_t  version;    // MFS_PROTOCOL_VERSION
+    uint8_t  opcode;     // MFS_OP_*
+    uint16_t length;     // bytes of data following the fixed fields
+    uint32_t session_id; // picked at random by the client at MFS_Init, 0 = none (mutations are not deduplicated)
+    uint32_t request_id; // numbered by the client within its session; both ids are echoed in the reply
+} MFS_Header;
+
+typedef struct __MFS_Request {
+    MFS_Header hdr;
+    int32_t    inum;
+    int32_t    arg;                  // block (Read, Write, first of a range), file type (Creat), flags (ReadDir),
+                                     // byte offset (ReadAt, WriteAt)
+    int32_t    count;                // blocks (ReadRange, WriteRange), bytes of records (ReadDir), bytes (ReadAt)
+    char       data[MFS_DATA_MAX];   // name or path including '\0' (Lookup, LookupPath, Creat, Unlink), block (Write),
+                                     // count blocks (WriteRange), uint64_t cursor (ReadDir), the bytes (WriteAt)
+} MFS_Request;
+
+typedef struct __MFS_Reply {
+    MFS_Header hdr;
+    int32_t    return_val;
+    uint64_t   version;              // of the inode (Read, ReadRange, ReadAt, Stat, ReadDir), changes whenever the inode or its blocks do
+    char       data[MFS_DATA_MAX];   // MFS_Stat_t (Stat, LookupPath), block (Read), return_val blocks (ReadRange),
+                                     // return_val bytes (ReadAt),
+                                     // next uint64_t cursor then return_val bytes of records (ReadDir)
+} MFS_Reply;
 
-typedef struct __MFS_ClientToServer {
-    char filename[252];
-    char cmd[20];
-    int filetype;
-    int inum;
-    int block;
-    char buffer[MFS_BLOCK_SIZE];
-} MFS_ClientToServer;
-
-typedef struct __MFS_ServerToClient {
-    int return_val;
-    MFS_Stat_t stat;
-    char buffer[MFS_BLOCK_SIZE];
-} MFS_ServerToClient;
+#define MFS_REQUEST_HEADER_SIZE (offsetof(MFS_Request, data))
+#define MFS_REPLY_HEADER_SIZE   (offsetof(MFS_Reply, data))
 
 #endif // __MFS_h__
\ No newline at end of file
@@ -12,7 +12,7 @@ int find_inum_of_name(FSImage* my_fsi, char* name) {
   int parent_dir_inum = 0;
   int found_inum = -1;
   bool found = false;
-  while(!found && parent_dir_inum < INODE_TABLE_SIZE) {
+  while(!found && (uint32_t)parent_dir_inum < my_fsi->sb->inode_count) {
     found_inum = SMFS_lookup(my_fsi, parent_dir_inum, name);
     if(found_inum > 0) {
       found = true;
@@ -35,7 +35,7 @@ int main(int argc, char *argv[]) {
     assert(sd > -1);
 
     char const* file_system_image = argv[2];
-    FSImage* my_fsi = SMFS_open_file_system_image(file_system_image);
+    FSImage* my_fsi = SMFS_open_file_system_image(file_system_image, FSI_BUFFERED);
 
     SMFS_create_file(my_fsi, 0, I_FILE, "abc");
     SMFS_create_file(my_fsi, 0, I_DIRECTORY, "def");
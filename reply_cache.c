@@ -0,0 +1,28 @@
+#include "reply_cache.h"
+
+static reply_cache_entry* slot_of(reply_cache* cache, uint32_t session_id, uint32_t request_id) {
+    // a client numbers its requests consecutively, so the ids of one session spread over consecutive slots
+    uint32_t hash = session_id * 2654435761u + request_id;
+    return &cache->entries[hash & (REPLY_CACHE_SIZE - 1)];
+}
+
+reply_state reply_cache_begin(reply_cache* cache, uint32_t session_id, uint32_t request_id, int32_t* return_val) {
+    reply_cache_entry* entry = slot_of(cache, session_id, request_id);
+    if (entry->session_id == session_id && entry->request_id == request_id) {
+        if (!entry->done)
+            return REPLY_IN_PROGRESS;
+        *return_val = entry->return_val;
+        return REPLY_DONE;
+    }
+    *entry = (reply_cache_entry){ .session_id = session_id, .request_id = request_id };
+    return REPLY_NEW;
+}
+
+void reply_cache_end(reply_cache* cache, uint32_t session_id, uint32_t request_id, int32_t return_val) {
+    reply_cache_entry* entry = slot_of(cache, session_id, request_id);
+    // evicted while it executed: nothing to remember it by
+    if (entry->session_id == session_id && entry->request_id == request_id) {
+        entry->return_val = return_val;
+        entry->done = true;
+    }
+}
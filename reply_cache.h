@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Results of recently executed mutations, keyed by the (session, request id) the client put in the request, so a
+// retransmission whose reply was lost is answered again instead of being executed a second time. Direct-mapped:
+// a new request evicts whatever shared its slot. Kept in memory only, after a restart retries execute again.
+
+#define REPLY_CACHE_SIZE 4096 // power of two
+
+typedef enum { REPLY_NEW, REPLY_IN_PROGRESS, REPLY_DONE } reply_state;
+
+typedef struct reply_cache_entry_ {
+    uint32_t session_id; // 0 = unused slot
+    uint32_t request_id;
+    int32_t  return_val; // valid once done, mutations reply with nothing but their return value
+    bool     done;
+} reply_cache_entry;
+
+typedef struct reply_cache_ {
+    reply_cache_entry entries[REPLY_CACHE_SIZE];
+} reply_cache;
+
+// REPLY_NEW: the request is recorded as in progress, execute it and then call reply_cache_end();
+// REPLY_DONE: *return_val is its result; REPLY_IN_PROGRESS: it is being executed right now
+reply_state reply_cache_begin (reply_cache* cache, uint32_t session_id, uint32_t request_id, int32_t* return_val);
+void        reply_cache_end   (reply_cache* cache, uint32_t session_id, uint32_t request_id, int32_t return_val);
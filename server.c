@@ -1,8 +1,54 @@
+#define _GNU_SOURCE // struct mmsghdr
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <sys/select.h>
 #include "udp.h"
 #include "server_mfs.h"
 
 // #define BUFFER_SIZE (4096)
+#define GROUP_MAX (64) // requests whose updates can share one log fsync
+#define WORKERS_MAX (64)
+
+typedef struct pending_reply_ {
+    struct sockaddr_in addr;
+    int length;          // bytes of reply to send
+    char const* data;    // reply.hdr.length bytes sent after the fixed fields, may point into the image
+    MFS_Reply reply;
+} pending_reply;
+
+// one thread serving its own socket, all of them share the image
+typedef struct worker_ {
+    pthread_t thread;
+    FSImage* my_fsi;
+    int sd;
+    bool zero_copy;         // reply data may point into the image, only while no other worker can change it
+    long group_window_usec;
+    int batch_size;
+    pending_reply replies[GROUP_MAX];
+    MFS_Request requests[GROUP_MAX];
+    struct mmsghdr msgs[GROUP_MAX];
+    struct iovec iovs[GROUP_MAX][2];
+} worker;
+
+// give replies that point into the image their own copy of the data before a request can change it
+static void detach_replies(pending_reply* replies, int count) {
+    for (int i = 0; i < count; i++) {
+      if (replies[i].data != replies[i].reply.data) {
+        memcpy(replies[i].reply.data, replies[i].data, replies[i].reply.hdr.length);
+        replies[i].data = replies[i].reply.data;
+      }
+    }
+}
+
+// wait until sd has a datagram, at most window_usec (forever if < 0)
+static bool wait_readable(int sd, long window_usec) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(sd, &readfds);
+    struct timeval timeout = { .tv_sec = window_usec / 1000000, .tv_usec = window_usec % 1000000 };
+    return select(sd+1, &readfds, NULL, NULL, window_usec < 0 ? NULL : &timeout) > 0;
+}
 
 // void print_stat(int inum, MFS_Stat_t* stat) {
 //   printf("inode %d: type=%d, size=%d, blocks=%d\n", inum, stat->type, stat->size, stat->blocks);
@@ -23,39 +69,140 @@
 //   return found_inum;
 // }
 
+static void* worker_main(void* arg) {
+    worker* w = arg;
+    FSImage* my_fsi = w->my_fsi;
+    int sd = w->sd;
+    int batch_size = w->batch_size;
+    pending_reply* replies = w->replies;
+    MFS_Request* requests = w->requests;
+    struct mmsghdr* msgs = w->msgs;
+    struct iovec (*iovs)[2] = w->iovs;
+    while (1) {
+      // execute every request that arrives within the group commit window, then make all of
+      // their updates durable with one log fsync before any of them is answered
+      int count = 0;
+      SMFS_begin_group(my_fsi);
+      do {
+        // drain whatever is queued with one system call, blocking only until the first datagram is there
+        int n = GROUP_MAX - count < batch_size ? GROUP_MAX - count : batch_size;
+        for (int i = 0; i < n; i++) {
+          iovs[i][0] = (struct iovec){ .iov_base = &requests[i], .iov_len = sizeof requests[i] };
+          msgs[i].msg_hdr = (struct msghdr){ .msg_name = &replies[count+i].addr, .msg_iov = iovs[i], .msg_iovlen = 1 };
+        }
+        int received = UDP_ReadBatch(sd, msgs, n, MSG_WAITFORONE); //read message buffers from port sd
+
+        for (int i = 0; i < received; i++) {
+          pending_reply* pending = &replies[count+i];
+          int rc = msgs[i].msg_len;
+          printf("SERVER:: read %d bytes (op %d)\n", rc, requests[i].hdr.opcode);
+
+          if (SMFS_is_mutation(&requests[i]))
+            detach_replies(replies, count+i);
+          pending->length = SMFS_exec(my_fsi, &requests[i], rc, &pending->reply, w->zero_copy ? &pending->data : NULL);
+          pending->data = w->zero_copy ? pending->data : pending->reply.data;
+          if (pending->length < 0)
+            printf("SERVER:: dropped request (%d bytes), garbled or still in progress\n", rc);
+        }
+        if (received > 0)
+          count += received;
+      } while (count < GROUP_MAX && wait_readable(sd, count == 0 ? -1 : w->group_window_usec));
+      SMFS_end_group(my_fsi);
+
+      // header and fixed fields from the reply, data from wherever it is (zero-copy for block reads)
+      int sending = 0;
+      for (int i = 0; i < count; i++) {
+        if (replies[i].length < 0)
+          continue;
+        iovs[sending][0] = (struct iovec){ .iov_base = &replies[i].reply,      .iov_len = MFS_REPLY_HEADER_SIZE };
+        iovs[sending][1] = (struct iovec){ .iov_base = (char*)replies[i].data, .iov_len = replies[i].reply.hdr.length };
+        msgs[sending].msg_hdr = (struct msghdr){
+          .msg_name = &replies[i].addr, .msg_namelen = sizeof replies[i].addr, .msg_iov = iovs[sending], .msg_iovlen = 2
+        };
+        ++sending;
+      }
+      for (int first = 0; first < sending; first += batch_size)
+        UDP_WriteBatch(sd, msgs + first, sending - first < batch_size ? sending - first : batch_size); //write message buffers to port sd
+    }
+    return NULL;
+}
+
+// wait for SIGINT or SIGTERM, then close the image so the next start has no log to replay
+static void* shutdown_main(void* arg) {
+    FSImage* my_fsi = arg;
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    int sig;
+    sigwait(&stop_signals, &sig);
+    printf("SERVER:: stopping on signal %d\n", sig);
+    SMFS_close_file_system_image(my_fsi);
+    exit(0);
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
-    if(argc<3)
+    fsi_mode mode = FSI_BUFFERED;
+    long group_window_usec = 0; // 0 = group only the requests already queued
+    int batch_size = GROUP_MAX; // datagrams per recvmmsg/sendmmsg call
+    int worker_count = 1;
+    uint32_t max_zones = ZONES_MAX;
+    int opt;
+    while ((opt = getopt(argc, argv, "mg:b:t:z:")) != -1) {
+      switch (opt) {
+        case 'm': mode = FSI_MMAP; break; // map the image privately, pages load on demand instead of all at open
+        case 'g': group_window_usec = atol(optarg); break; // how long to wait for more requests to share a log fsync
+        case 'b': batch_size = atoi(optarg); break; // 1 = one system call per datagram
+        case 't': worker_count = atoi(optarg); break; // threads, each with its own socket on the port
+        case 'z': max_zones = strtoul(optarg, NULL, 10); break; // the image doesn't grow past this many zones
+        default: break;
+      }
+    }
+    if (batch_size < 1 || batch_size > GROUP_MAX)
+      batch_size = GROUP_MAX;
+    if (worker_count < 1 || worker_count > WORKERS_MAX)
+      worker_count = 1;
+
+    if(argc-optind<2)
     {
-      printf("Usage: server [server-port-number] [file-system-image]\n");
+      printf("Usage: server [-m] [-g group-commit-window-usec] [-b datagrams-per-syscall] [-t worker-threads] [-z max-zones] [server-port-number] [file-system-image]\n");
       exit(1);
     }
 
-    int portid = atoi(argv[1]);
-    int sd = UDP_Open(portid); //port # 
-    assert(sd > -1);
+    int portid = atoi(argv[optind]);
+    worker* workers = calloc(worker_count, sizeof *workers);
+    assert(workers != NULL);
+    for (int i = 0; i < worker_count; i++) {
+      workers[i].sd = worker_count == 1 ? UDP_Open(portid) : UDP_OpenShared(portid); //port # 
+      assert(workers[i].sd > -1);
+      UDP_SetBufferSize(workers[i].sd, MFS_WINDOW_MAX * 2 * sizeof(MFS_Request)); // a client's full window of writes can queue
+    }
 
-    char const* file_system_image = argv[2];
-    FSImage* my_fsi = SMFS_open_file_system_image(file_system_image);
+    // only shutdown_main() takes the stop signals, every thread created from here on inherits the mask
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    char const* file_system_image = argv[optind+1];
+    FSImage* my_fsi = SMFS_open_file_system_image(file_system_image, mode);
+    assert(my_fsi != NULL);
+    SMFS_set_max_zones(my_fsi, max_zones);
+    pthread_t shutdown_thread;
+    pthread_create(&shutdown_thread, NULL, shutdown_main, my_fsi);
 
     printf("waiting in loop\n");
 
-    while (1) {
-	    struct sockaddr_in s;
-      MFS_ClientToServer request = {0};
-
-	    int rc = UDP_Read(sd, &s, (char*)&request, sizeof request); //read message buffer from port sd
-	    if (rc > 0) {
-	        printf("SERVER:: read %d bytes (cmd: '%s')\n", rc, request.cmd);
-          MFS_ServerToClient response = {0};
-
-          int exec_success = SMFS_exec(my_fsi, &request, &response);
-          if (exec_success < 0) {
-            printf("SERVER:: exec failed (cmd: '%s')\n", request.cmd);
-            continue;
-          }
-
-	        rc = UDP_Write(sd, &s, (char*)&response, sizeof response); //write message buffer to port sd
-	    }
+    for (int i = 0; i < worker_count; i++) {
+      workers[i].my_fsi = my_fsi;
+      workers[i].zero_copy = worker_count == 1;
+      workers[i].group_window_usec = group_window_usec;
+      workers[i].batch_size = batch_size;
+      if (i > 0)
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
     }
+    worker_main(&workers[0]);
     return 0;
 }
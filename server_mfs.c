@@ -1,31 +1,709 @@
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "server_mfs.h"
 
+// images before version 5 had a single fixed size zone
+#define INODE_TABLE_SIZE 4096
+#define BLOCK_COUNT      4096
+
+// superblock of versions 2 to 4, at the start of the image
+typedef struct superblock_v4_ {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t inode_count;
+    uint32_t block_count;
+} superblock_v4;
+
+// version 1 on-disk layout, only used to convert old images
+typedef struct inode_v1_ {
+    unsigned size;
+    unsigned block_alloc_count;
+    uint64_t block_ptrs[BLOCK_PTRS]; // raw block* into the data_blocks of the process that wrote it
+    i_type   type;
+} inode_v1;
+
+typedef struct SMFS_v1_ {
+    bitarray inode_alloc;
+    bitarray block_alloc;
+    inode_v1 inode_table[INODE_TABLE_SIZE];
+    block    data_blocks[BLOCK_COUNT];
+} SMFS_v1;
+
+// version 2 on-disk layout, only used to convert old images
+typedef struct inode_v2_ {
+    unsigned size;
+    unsigned block_alloc_count;
+    uint32_t block_nums[BLOCK_PTRS]; // indices into data_blocks, [0, block_alloc_count) are in use
+    i_type   type;
+} inode_v2;
+
+typedef struct SMFS_v2_ {
+    superblock_v4 sb;
+    bitarray      inode_alloc;
+    bitarray      block_alloc;
+    inode_v2      inode_table[INODE_TABLE_SIZE];
+    block         data_blocks[BLOCK_COUNT];
+} SMFS_v2;
+
+// version 3 on-disk layout, only used to convert old images
+typedef struct inode_v3_ {
+    unsigned size;
+    unsigned block_alloc_count;
+    uint16_t extent_count;
+    uint16_t prealloc_length;
+    uint32_t prealloc_start;
+    extent   extents[EXTENTS_MAX];
+    i_type   type;
+} inode_v3;
+
+typedef struct SMFS_v3_ {
+    superblock_v4 sb;
+    bitarray      inode_alloc;
+    bitarray      block_alloc;
+    inode_v3      inode_table[INODE_TABLE_SIZE];
+    block         data_blocks[BLOCK_COUNT];
+} SMFS_v3;
+
+// version 4 on-disk layout, only used to convert old images: the inodes are current, but there is one zone
+typedef struct SMFS_v4_ {
+    superblock_v4 sb;
+    bitarray      inode_alloc;
+    bitarray      block_alloc;
+    inode         inode_table[INODE_TABLE_SIZE];
+    block         data_blocks[BLOCK_COUNT];
+} SMFS_v4;
+
+#define ALLOC_WORD_BITS  32
+#define ALLOC_WORDS      (sizeof(bitarray) / sizeof(int32_t))
+
+// what the mutation in progress on this thread did to one zone
+typedef struct op_zone_ {
+    dirty_set dirty;        // regions modified, logged as one record when the operation completes
+    bitarray  freed_inodes; // handed back to the allocator by end_op(), as part of the operation's record
+    bitarray  freed_blocks;
+} op_zone;
+
+// the mutation in progress on this thread, between begin_op() and end_op()
+typedef struct op_state_ {
+    op_zone*  zones[ZONES_MAX]; // allocated the first time the thread touches the zone, then kept
+    bitarray  touched;      // zones the operation touched, bit z = zones[z]
+    bool      freed;        // anything in freed_inodes or freed_blocks of a zone
+    uint64_t  locked;       // inode lock stripes held exclusively, bit i = inode_locks[i]
+} op_state;
+
+static __thread op_state op;
+static __thread int group_depth; // > 0 while this thread's SMFS_begin_group() defers the log fsync
+
+static int grow_volume(FSImage* my_fsi, uint32_t seen);
+
+// zones in use, for threads that don't hold block_alloc_lock (the count only grows)
+static uint32_t zone_count(FSImage* my_fsi) {
+    return __atomic_load_n(&my_fsi->zone_count, __ATOMIC_ACQUIRE);
+}
+
+static inode* get_inode(FSImage* my_fsi, uint32_t inum) {
+    return &my_fsi->zones[inum / ZONE_INODES]->disk->inode_table[inum % ZONE_INODES];
+}
+
+static block* get_block(FSImage* my_fsi, uint32_t blknum) {
+    return &my_fsi->zones[blknum / ZONE_BLOCKS]->disk->data_blocks[blknum % ZONE_BLOCKS];
+}
+
+static op_zone* touch_zone(uint32_t z) {
+    if (op.zones[z] == NULL) {
+        op.zones[z] = calloc(1, sizeof(op_zone));
+        assert(op.zones[z] != NULL);
+    }
+    set_bit(op.touched, z);
+    return op.zones[z];
+}
+
+static void mark_inode_alloc_dirty(FSImage* my_fsi, int inum) {
+    set_bit(touch_zone(inum / ZONE_INODES)->dirty.alloc_words, inum % ZONE_INODES / ALLOC_WORD_BITS);
+}
+
+static void mark_block_alloc_dirty(FSImage* my_fsi, int blknum) {
+    set_bit(touch_zone(blknum / ZONE_BLOCKS)->dirty.alloc_words, ALLOC_WORDS + blknum % ZONE_BLOCKS / ALLOC_WORD_BITS);
+}
+
+static void mark_inode_dirty(FSImage* my_fsi, int inum) {
+    // once per operation, with the inode locked: a reader that sees the new version waits for the lock
+    // and so reads the new contents too
+    op_zone* oz = touch_zone(inum / ZONE_INODES);
+    if (!test_bit(oz->dirty.inodes, inum % ZONE_INODES))
+        __atomic_fetch_add(&my_fsi->zones[inum / ZONE_INODES]->inode_versions[inum % ZONE_INODES], 1, __ATOMIC_RELEASE);
+    set_bit(oz->dirty.inodes, inum % ZONE_INODES);
+}
+
+static void mark_block_dirty(FSImage* my_fsi, uint32_t blknum) {
+    set_bit(touch_zone(blknum / ZONE_BLOCKS)->dirty.blocks, blknum % ZONE_BLOCKS);
+}
+
+/*
+Allocate a data block, -1 if the volume is out of blocks. Zones are searched next-fit from the one that had
+the last free block; when all of them are full the volume grows by a zone. Called with block_alloc_lock held.
+*/
 static int empty_block_index(FSImage* my_fsi) {
-    int i = 0;
-    while (test_bit(my_fsi->mfs->block_alloc, i)) {
-        ++i;
+    while (1) {
+        uint32_t count = my_fsi->zone_count;
+        for (uint32_t n = 0; n < count; n++) {
+            uint32_t z = (my_fsi->block_zone + n) % count;
+            zone* zn = my_fsi->zones[z];
+            int i = zn->block_hint.free > 0 ? find_zero_and_set(zn->disk->block_alloc, ZONE_BLOCKS, &zn->block_hint) : -1;
+            if (i > -1) {
+                int blknum = z * ZONE_BLOCKS + i;
+                my_fsi->block_zone = z;
+                __atomic_fetch_sub(&my_fsi->free_blocks, 1, __ATOMIC_RELAXED);
+                mark_block_alloc_dirty(my_fsi, blknum);
+                return blknum;
+            }
+        }
+        if (grow_volume(my_fsi, count) < 0)
+            return -1;
     }
-    set_bit(my_fsi->mfs->block_alloc, i); // should this be done automatically here?
-    return i;   
 }
 
+// allocate an inode, -1 if the inode table is full (inode 0 is root directory inode, always allocated)
 static int empty_inode_index(FSImage* my_fsi) {
-    int i = 1; // inode 0 is root directory inode
-    while (test_bit(my_fsi->mfs->inode_alloc, i)) {
+    while (1) {
+        uint32_t count = zone_count(my_fsi);
+        for (uint32_t n = 0; n < count; n++) {
+            uint32_t z = (my_fsi->inode_zone + n) % count;
+            zone* zn = my_fsi->zones[z];
+            int i = zn->inode_hint.free > 0 ? find_zero_and_set(zn->disk->inode_alloc, ZONE_INODES, &zn->inode_hint) : -1;
+            if (i > -1) {
+                int inum = z * ZONE_INODES + i;
+                my_fsi->inode_zone = z;
+                __atomic_fetch_sub(&my_fsi->free_inodes, 1, __ATOMIC_RELAXED);
+                mark_inode_alloc_dirty(my_fsi, inum);
+                return inum;
+            }
+        }
+        // inode_alloc_lock comes before block_alloc_lock, which guards growth
+        pthread_mutex_lock(&my_fsi->block_alloc_lock);
+        int rc = grow_volume(my_fsi, count);
+        pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+        if (rc < 0)
+            return -1;
+    }
+}
+
+/*
+Allocate length free blocks in a row, -1 if no zone has such a run (runs don't cross zones). Doesn't grow the
+volume, the caller falls back to single blocks. Called with block_alloc_lock held.
+*/
+static int empty_block_run(FSImage* my_fsi, int length) {
+    for (uint32_t n = 0; n < my_fsi->zone_count; n++) {
+        uint32_t z = (my_fsi->block_zone + n) % my_fsi->zone_count;
+        zone* zn = my_fsi->zones[z];
+        int i = zn->block_hint.free >= length ? find_zero_run_and_set(zn->disk->block_alloc, ZONE_BLOCKS, length, &zn->block_hint) : -1;
+        if (i > -1) {
+            int run = z * ZONE_BLOCKS + i;
+            my_fsi->block_zone = z;
+            __atomic_fetch_sub(&my_fsi->free_blocks, length, __ATOMIC_RELAXED);
+            for (int k = 0; k < length; k++)
+                mark_block_alloc_dirty(my_fsi, run + k);
+            return run;
+        }
+    }
+    return -1;
+}
+
+// allocate block blknum if it is free. Called with block_alloc_lock held.
+static bool take_block(FSImage* my_fsi, uint32_t blknum) {
+    if (blknum >= my_fsi->zone_count * ZONE_BLOCKS)
+        return false;
+    zone* zn = my_fsi->zones[blknum / ZONE_BLOCKS];
+    if (test_bit(zn->disk->block_alloc, blknum % ZONE_BLOCKS))
+        return false;
+    set_bit(zn->disk->block_alloc, blknum % ZONE_BLOCKS);
+    --(zn->block_hint.free);
+    __atomic_fetch_sub(&my_fsi->free_blocks, 1, __ATOMIC_RELAXED);
+    mark_block_alloc_dirty(my_fsi, blknum);
+    return true;
+}
+
+static void remove_block_from_bitarray(FSImage* my_fsi, uint32_t blknum) {
+    zone* zn = my_fsi->zones[blknum / ZONE_BLOCKS];
+    release_bit(zn->disk->block_alloc, blknum % ZONE_BLOCKS, &zn->block_hint);
+    __atomic_fetch_add(&my_fsi->free_blocks, 1, __ATOMIC_RELAXED);
+    mark_block_alloc_dirty(my_fsi, blknum);
+}
+
+/*
+Free a block or inode the operation no longer references. They stay allocated until end_op() logs the
+operation and its release with it: another operation could otherwise reuse them and get into the log first,
+and a crash in between would leave them owned twice.
+*/
+static void free_block(FSImage* my_fsi, uint32_t blknum) {
+    set_bit(touch_zone(blknum / ZONE_BLOCKS)->freed_blocks, blknum % ZONE_BLOCKS);
+    op.freed = true;
+}
+
+static void free_inode(FSImage* my_fsi, int inum) {
+    set_bit(touch_zone(inum / ZONE_INODES)->freed_inodes, inum % ZONE_INODES);
+    op.freed = true;
+}
+
+// number of extents in extents[0, count) that start at or before file block lblk
+static int extents_up_to(extent const* extents, int count, uint32_t lblk) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (extents[mid].lblk <= lblk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// index into extents[0, count) of the extent mapping file block lblk, -1 if lblk is a hole
+static int find_extent(extent const* extents, int count, uint32_t lblk) {
+    int i = extents_up_to(extents, count, lblk) - 1;
+    if (i < 0 || lblk >= extents[i].lblk + extents[i].length)
+        return -1;
+    return i;
+}
+
+// index into entries[0, count) of the child block for file block lblk
+static int find_child(extent_idx const* entries, int count, uint32_t lblk) {
+    int lo = 1, hi = count; // entries[0] starts where its parent's entry does
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (entries[mid].lblk <= lblk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+// a sorted run of extents, in the inode itself or in one of its leaf blocks
+typedef struct extent_list_ {
+    extent*   extents;
+    uint16_t* count;
+    int       max;
+    int       leaf;    // block holding them, -1 = the inode
+} extent_list;
+
+// sorted index entries, in the inode itself or in one of its index blocks
+typedef struct index_list_ {
+    extent_idx* entries;
+    uint16_t*   count;
+    int         max;
+    int         block;   // block holding them, -1 = the inode
+} index_list;
+
+static extent_list inode_extents(inode* in) {
+    return (extent_list){ .extents = in->extents, .count = &in->extent_count, .max = EXTENTS_MAX, .leaf = -1 };
+}
+
+static extent_list leaf_extents(FSImage* my_fsi, uint32_t blknum) {
+    extent_leaf* leaf = &get_block(my_fsi, blknum)->b_extents;
+    return (extent_list){ .extents = leaf->extents, .count = &leaf->count, .max = LEAF_EXTENTS_MAX, .leaf = blknum };
+}
+
+static index_list inode_index(inode* in) {
+    return (index_list){ .entries = in->index, .count = &in->extent_count, .max = EXTENTS_MAX, .block = -1 };
+}
+
+static index_list block_index(FSImage* my_fsi, uint32_t blknum) {
+    extent_index* index = &get_block(my_fsi, blknum)->b_index;
+    return (index_list){ .entries = index->entries, .count = &index->count, .max = INDEX_ENTRIES_MAX, .block = blknum };
+}
+
+/*
+The extents that map file block lblk if it is mapped: a binary search at each level of index on the way down.
+If path isn't NULL, path[d] and slot[d] are set to the index list at depth d (0 = the inode's) and the entry in
+it that was followed.
+*/
+static extent_list find_extents(FSImage* my_fsi, inode* in, uint32_t lblk, index_list* path, int* slot) {
+    if (in->extent_depth == 0)
+        return inode_extents(in);
+    index_list node = inode_index(in);
+    for (int d = 0;; d++) {
+        int k = find_child(node.entries, *node.count, lblk);
+        if (path != NULL) {
+            path[d] = node;
+            slot[d] = k;
+        }
+        if (d + 1 == in->extent_depth)
+            return leaf_extents(my_fsi, node.entries[k].child);
+        node = block_index(my_fsi, node.entries[k].child);
+    }
+}
+
+static extent_list extents_of(FSImage* my_fsi, inode* in, uint32_t lblk) {
+    return find_extents(my_fsi, in, lblk, NULL, NULL);
+}
+
+typedef void (*block_visitor)(FSImage* my_fsi, uint32_t blknum, void* arg);
+
+static void visit_extents(FSImage* my_fsi, extent_list list, block_visitor visit, void* arg) {
+    for (int i = 0; i < *list.count; i++) {
+        for (uint32_t j = 0; j < list.extents[i].length; j++)
+            visit(my_fsi, list.extents[i].start + j, arg);
+    }
+}
+
+static void visit_children(FSImage* my_fsi, index_list node, int levels, block_visitor visit, void* arg) {
+    for (int k = 0; k < *node.count; k++) {
+        uint32_t child = node.entries[k].child;
+        if (levels > 1)
+            visit_children(my_fsi, block_index(my_fsi, child), levels - 1, visit, arg);
+        else
+            visit_extents(my_fsi, leaf_extents(my_fsi, child), visit, arg);
+        visit(my_fsi, child, arg);
+    }
+}
+
+// call visit on every block inode in maps: its data blocks and the leaf and index blocks of its extent tree
+static void visit_mapped_blocks(FSImage* my_fsi, inode* in, block_visitor visit, void* arg) {
+    if (in->extent_depth == 0)
+        visit_extents(my_fsi, inode_extents(in), visit, arg);
+    else
+        visit_children(my_fsi, inode_index(in), in->extent_depth, visit, arg);
+}
+
+// extent mapping file block lblk, NULL if lblk is a hole; a binary search in the inode, then in one leaf
+static extent* lookup_extent(FSImage* my_fsi, inode* in, uint32_t lblk) {
+    extent_list list = extents_of(my_fsi, in, lblk);
+    int i = find_extent(list.extents, *list.count, lblk);
+    return i < 0 ? NULL : &list.extents[i];
+}
+
+// data block backing file block lblk, -1 if lblk is a hole
+static int inode_lookup_block(FSImage* my_fsi, inode* in, uint32_t lblk) {
+    extent const* e = lookup_extent(my_fsi, in, lblk);
+    if (e == NULL)
+        return -1;
+    return e->start + (lblk - e->lblk);
+}
+
+// merge neighbouring extents that are contiguous both in the file and on disk
+static void normalize_extents(inode* in) {
+    int i = 0;
+    while (i + 1 < in->extent_count) {
+        extent* e = &in->extents[i];
+        extent* next = &in->extents[i+1];
+        if (e->lblk + e->length == next->lblk && e->start + e->length == next->start) {
+            e->length += next->length;
+            memmove(next, next + 1, (in->extent_count - i - 2) * sizeof *next);
+            --(in->extent_count);
+        } else {
+            ++i;
+        }
+    }
+}
+
+// whether mapping file block lblk to data block blknum grows an extent of extents[0, count) rather than adding one
+static bool continues_extent(extent const* extents, int count, uint32_t lblk, uint32_t blknum) {
+    int i = extents_up_to(extents, count, lblk);
+    extent const* prev = i > 0 ? &extents[i-1] : NULL;
+    extent const* next = i < count ? &extents[i] : NULL;
+    return (prev && prev->lblk + prev->length == lblk && prev->start + prev->length == blknum) ||
+        (next && next->lblk == lblk + 1 && next->start == blknum + 1);
+}
+
+/*
+Map file block lblk to data block blknum in extents[0, *count), growing a neighbouring extent when the block
+continues it. Returns false if it takes a new extent and there are already max.
+*/
+static bool insert_extent(extent* extents, uint16_t* count, int max, uint32_t lblk, uint32_t blknum) {
+    int i = extents_up_to(extents, *count, lblk);
+    extent* prev = i > 0 ? &extents[i-1] : NULL;
+    extent* next = i < *count ? &extents[i] : NULL;
+    bool joins_next = next && next->lblk == lblk + 1 && next->start == blknum + 1;
+    if (prev && prev->lblk + prev->length == lblk && prev->start + prev->length == blknum) {
+        ++(prev->length);
+        if (joins_next) {
+            prev->length += next->length;
+            memmove(next, next + 1, (*count - i - 1) * sizeof *next);
+            --(*count);
+        }
+        return true;
+    }
+    if (joins_next) {
+        --(next->lblk);
+        --(next->start);
+        ++(next->length);
+        return true;
+    }
+    if (*count == max)
+        return false;
+    memmove(&extents[i+1], &extents[i], (*count - i) * sizeof *extents);
+    extents[i] = (extent){ .lblk = lblk, .start = blknum, .length = 1 };
+    ++(*count);
+    return true;
+}
+
+// called with block_alloc_lock held
+static void release_prealloc(FSImage* my_fsi, int inum) {
+    inode* in = get_inode(my_fsi, inum);
+    for (uint32_t i = 0; i < in->prealloc_length; i++)
+        remove_block_from_bitarray(my_fsi, in->prealloc_start + i);
+    in->prealloc_start = 0;
+    in->prealloc_length = 0;
+    mark_inode_dirty(my_fsi, inum);
+}
+
+/*
+Hand back the preallocation windows of every file the operation can lock, used when the volume runs out of free
+blocks. Called with block_alloc_lock held, so stripes held elsewhere are skipped rather than waited for (files
+busy in other operations keep their windows); the stripes taken stay locked until end_op().
+*/
+static void reclaim_preallocations(FSImage* my_fsi) {
+    for (int stripe = 0; stripe < INODE_LOCK_STRIPES; stripe++) {
+        if (!(op.locked & (1ull << stripe))) {
+            if (pthread_rwlock_trywrlock(&my_fsi->inode_locks[stripe]) != 0)
+                continue;
+            op.locked |= 1ull << stripe;
+        }
+        for (uint32_t inum = stripe; inum < my_fsi->zone_count * ZONE_INODES; inum += INODE_LOCK_STRIPES) {
+            if (get_inode(my_fsi, inum)->prealloc_length > 0)
+                release_prealloc(my_fsi, inum);
+        }
+    }
+}
+
+// a zeroed block for extents, -1 if the volume is full. Called with block_alloc_lock held.
+static int alloc_leaf(FSImage* my_fsi) {
+    int blknum = empty_block_index(my_fsi);
+    if (blknum < 0) {
+        reclaim_preallocations(my_fsi);
+        blknum = empty_block_index(my_fsi);
+    }
+    if (blknum > -1) {
+        memset(get_block(my_fsi, blknum), 0, sizeof(block));
+        mark_block_dirty(my_fsi, blknum);
+    }
+    return blknum;
+}
+
+// add an entry for child, which holds the file blocks from lblk on, after entry k of node
+static void insert_child(FSImage* my_fsi, index_list node, int k, uint32_t lblk, uint32_t child) {
+    memmove(&node.entries[k+2], &node.entries[k+1], (*node.count - k - 1) * sizeof *node.entries);
+    node.entries[k+1] = (extent_idx){ .lblk = lblk, .child = child };
+    ++(*node.count);
+    if (node.block > -1)
+        mark_block_dirty(my_fsi, node.block);
+}
+
+/*
+Make room for one more extent where file block lblk of inode inum would be mapped, so that mapping it can't
+fail half way. Extents that outgrow the inode move to a leaf block and the inode becomes an index of leaves.
+A full leaf is split in two, adding an entry to the index above it; a full index block is split the same
+way, and once the inode's own index is full it moves to an index block and the tree grows a level. Splits
+go top down, so the parent of the list being split always has room. A file that only grows keeps its leaves
+and index blocks full by starting the new ones at lblk. Returns -1 if the volume is full. Called with
+block_alloc_lock held.
+*/
+static int reserve_extent(FSImage* my_fsi, int inum, uint32_t lblk) {
+    inode* in = get_inode(my_fsi, inum);
+    for (;;) {
+        index_list path[EXTENT_DEPTH_MAX];
+        int slot[EXTENT_DEPTH_MAX];
+        extent_list list = find_extents(my_fsi, in, lblk, path, slot);
+        if (*list.count < list.max)
+            return 0;
+        int depth = in->extent_depth;
+        int d = 0; // the highest full list on the way down, depth = the leaf
+        while (d < depth && *path[d].count < path[d].max)
+            ++d;
+        if (d == 0 && depth == EXTENT_DEPTH_MAX) {
+            fprintf(stderr, "ERROR: (reserve_extent) inode %d has too many extents\n", inum);
+            return -1;
+        }
+        int blknum = alloc_leaf(my_fsi);
+        if (blknum < 0)
+            return -1;
+
+        if (depth == 0) {
+            extent_leaf* leaf = &get_block(my_fsi, blknum)->b_extents;
+            memcpy(leaf->extents, in->extents, in->extent_count * sizeof(extent));
+            leaf->count = in->extent_count;
+            memset(in->index, 0, sizeof in->index);
+            in->index[0] = (extent_idx){ .lblk = 0, .child = blknum };
+            in->extent_count = 1;
+            in->extent_depth = 1;
+        } else if (d == 0) {
+            // the inode's index moves down a level
+            extent_index* index = &get_block(my_fsi, blknum)->b_index;
+            memcpy(index->entries, in->index, in->extent_count * sizeof(extent_idx));
+            index->count = in->extent_count;
+            memset(in->index, 0, sizeof in->index);
+            in->index[0] = (extent_idx){ .lblk = 0, .child = blknum };
+            in->extent_count = 1;
+            ++(in->extent_depth);
+        } else if (d < depth) {
+            // an appending file moves only its last entry, the leaf below it is split next
+            index_list full = path[d];
+            extent_index* index = &get_block(my_fsi, blknum)->b_index;
+            int keep = slot[d] == *full.count - 1 ? *full.count - 1 : *full.count / 2;
+            index->count = *full.count - keep;
+            memcpy(index->entries, full.entries + keep, index->count * sizeof(extent_idx));
+            memset(full.entries + keep, 0, index->count * sizeof(extent_idx));
+            *full.count = keep;
+            mark_block_dirty(my_fsi, full.block);
+            insert_child(my_fsi, path[d-1], slot[d-1], index->entries[0].lblk, blknum);
+        } else {
+            extent_leaf* leaf = &get_block(my_fsi, blknum)->b_extents;
+            extent const* last = &list.extents[*list.count - 1];
+            int keep = lblk >= last->lblk + last->length ? *list.count : *list.count / 2;
+            leaf->count = *list.count - keep;
+            memcpy(leaf->extents, list.extents + keep, leaf->count * sizeof(extent));
+            memset(list.extents + keep, 0, leaf->count * sizeof(extent));
+            *list.count = keep;
+            mark_block_dirty(my_fsi, list.leaf);
+            insert_child(my_fsi, path[d-1], slot[d-1], leaf->count > 0 ? leaf->extents[0].lblk : lblk, blknum);
+        }
+        mark_inode_dirty(my_fsi, inum);
+    }
+}
+
+/*
+Allocate a data block for file block lblk of inode inum and map it. Returns the block number, -1 if the
+volume is full.
+A file that grows sequentially extends its last extent: first into its preallocation window, then into
+any free block that directly follows it. Otherwise a new run of 1 + PREALLOC_BLOCKS blocks is reserved
+if one is free, the first block is mapped and the rest become the file's new preallocation window.
+Hashed directories grow the same way, legacy ones get single blocks and no preallocation. Called with
+block_alloc_lock held.
+*/
+static int inode_map_block(FSImage* my_fsi, int inum, uint32_t lblk) {
+    inode* in = get_inode(my_fsi, inum);
+    extent const* prev = lblk > 0 ? lookup_extent(my_fsi, in, lblk - 1) : NULL;
+    uint32_t goal = prev != NULL ? prev->start + (lblk - prev->lblk) : 0;
+    // the block that follows the previous one grows its extent, any other block may need room for a new one
+    extent_list list = extents_of(my_fsi, in, lblk);
+    if ((prev == NULL || !continues_extent(list.extents, *list.count, lblk, goal)) && reserve_extent(my_fsi, inum, lblk) < 0)
+        return -1;
+    int blknum = -1;
+
+    if (prev != NULL) {
+        if (in->prealloc_length > 0 && in->prealloc_start == goal) {
+            blknum = goal;
+            ++(in->prealloc_start);
+            --(in->prealloc_length);
+        } else if (take_block(my_fsi, goal)) {
+            blknum = goal;
+        }
+    }
+
+    if (blknum < 0) {
+        if (reserve_extent(my_fsi, inum, lblk) < 0)
+            return -1;
+        if (in->type == I_FILE || (in->flags & INODE_DIR_HASHED)) {
+            // new run: the old window no longer follows the end of the file
+            if (in->prealloc_length > 0)
+                release_prealloc(my_fsi, inum);
+            int run = empty_block_run(my_fsi, 1 + PREALLOC_BLOCKS);
+            if (run > -1) {
+                blknum = run;
+                in->prealloc_start = run + 1;
+                in->prealloc_length = PREALLOC_BLOCKS;
+            }
+        }
+        if (blknum < 0)
+            blknum = empty_block_index(my_fsi);
+        if (blknum < 0) {
+            reclaim_preallocations(my_fsi);
+            blknum = empty_block_index(my_fsi);
+        }
+        if (blknum < 0)
+            return -1;
+    }
+
+    // a block that used to belong to a file isn't zeroed when it is freed, a directory's must start out empty
+    if (in->type == I_DIRECTORY) {
+        memset(get_block(my_fsi, blknum), 0, sizeof(block));
+        mark_block_dirty(my_fsi, blknum);
+    }
+    list = extents_of(my_fsi, in, lblk);
+    bool inserted = insert_extent(list.extents, list.count, list.max, lblk, blknum);
+    assert(inserted);
+    if (list.leaf > -1)
+        mark_block_dirty(my_fsi, list.leaf);
+    ++(in->block_alloc_count);
+    mark_inode_dirty(my_fsi, inum);
+    return blknum;
+}
+
+static void free_visited_block(FSImage* my_fsi, uint32_t blknum, void* arg) {
+    free_block(my_fsi, blknum);
+}
+
+/*
+Free every block of inode inum, including its leaf and index blocks and preallocation window. The blocks keep
+their contents, so unlinking a large file doesn't log all of it.
+*/
+static void inode_free_blocks(FSImage* my_fsi, int inum) {
+    inode* in = get_inode(my_fsi, inum);
+    visit_mapped_blocks(my_fsi, in, free_visited_block, NULL);
+    for (uint32_t i = 0; i < in->prealloc_length; i++)
+        free_block(my_fsi, in->prealloc_start + i);
+    in->prealloc_start = 0;
+    in->prealloc_length = 0;
+    memset(in->extents, 0, sizeof in->extents);
+    in->extent_count = 0;
+    in->extent_depth = 0;
+    in->block_alloc_count = 0;
+    mark_inode_dirty(my_fsi, inum);
+}
+
+/*
+Free file block lblk of inode inum and move every later file block down by one, so the file stays
+dense (used by legacy directories, whose blocks are [0, block_alloc_count) and whose extents fit in the inode).
+*/
+static void inode_collapse_block(FSImage* my_fsi, int inum, uint32_t lblk) {
+    inode* in = get_inode(my_fsi, inum);
+    assert(in->extent_depth == 0);
+    int i = find_extent(in->extents, in->extent_count, lblk);
+    assert(i > -1);
+    extent* e = &in->extents[i];
+    uint32_t offset = lblk - e->lblk;
+    free_block(my_fsi, e->start + offset);
+
+    if (e->length == 1) {
+        memmove(e, e + 1, (in->extent_count - i - 1) * sizeof *e);
+        --(in->extent_count);
+    } else if (offset == 0) {
+        ++(e->start);
+        --(e->length);
+        ++i; // shifted below along with the following extents
+    } else if (offset == e->length - 1) {
+        --(e->length);
         ++i;
+    } else {
+        // split around the freed block, the tail is shifted below
+        extent tail = { .lblk = lblk + 1, .start = e->start + offset + 1, .length = e->length - offset - 1 };
+        e->length = offset;
+        assert(in->extent_count < EXTENTS_MAX);
+        memmove(&in->extents[i+2], &in->extents[i+1], (in->extent_count - i - 1) * sizeof *e);
+        in->extents[i+1] = tail;
+        ++(in->extent_count);
+        i += 1;
+    }
+    for (; i < in->extent_count; i++) {
+        if (in->extents[i].lblk > lblk)
+            --(in->extents[i].lblk);
     }
-    set_bit(my_fsi->mfs->inode_alloc, i); // should this be done automatically here?
-    return i;    
+    normalize_extents(in);
+    --(in->block_alloc_count);
+    mark_inode_dirty(my_fsi, inum);
 }
 
 static ssize_t get_dir_size(dir_file* dir) {
@@ -34,434 +712,2134 @@ static ssize_t get_dir_size(dir_file* dir) {
     return d_count_size + d_entries_size;
 }
 
-static int get_dir_entry_count(FSImage* my_fsi, int inum) {
-    inode* inode = &my_fsi->mfs->inode_table[inum];
-    int dir_entry_count = 0;
-    for(int i=0; i<BLOCK_PTRS; i++) {
-        dir_file* dir = &inode->block_ptrs[i]->b_directory;
-        if (dir != NULL) {
-            dir_entry_count += dir->d_count;
+static bool is_hashed_dir(inode const* in) {
+    return in->type == I_DIRECTORY && (in->flags & INODE_DIR_HASHED);
+}
+
+// entries of directory in, "." and ".." included: its size counts them as if they were dir_file_entries
+static uint32_t dir_entry_count(inode const* in) {
+    return in->size / sizeof(dir_file_entry);
+}
+
+// blocks MFS_Read() serves for directory in, DENTRIES_MAX entries each for a hashed one
+static uint32_t dir_blocks(inode const* in) {
+    return is_hashed_dir(in) ? (dir_entry_count(in) + DENTRIES_MAX - 1) / DENTRIES_MAX : in->block_alloc_count;
+}
+
+static bool is_dir_empty(FSImage* my_fsi, int inum) {
+    // a directory's size counts its entries, an empty one only has "." and ".."
+    return get_inode(my_fsi, inum)->size == 2 * sizeof(dir_file_entry);
+}
+
+/*
+Hashed directories. Where a name goes depends on how many buckets the directory has (linear hashing): with n
+buckets and level the largest power of two <= n, it is bucket hash mod level, or hash mod 2*level for the
+buckets [0, n - level) already split in this round. Adding bucket n splits bucket n - level, so a directory
+grows one block at a time and only the entries of one bucket move.
+*/
+
+// FNV-1a of the name, buckets are placed by it on disk so it must never change
+static uint32_t dir_name_hash(char const* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// largest power of two <= n
+static uint32_t bucket_level(uint32_t n) {
+    uint32_t level = 1;
+    while (level <= n / 2)
+        level *= 2;
+    return level;
+}
+
+// bucket of a name with hash hash in a directory of n buckets
+static uint32_t dir_bucket_of(uint32_t hash, uint32_t n) {
+    uint32_t level = bucket_level(n);
+    uint32_t b = hash & (level - 1);
+    return b < n - level ? hash & (2 * level - 1) : b;
+}
+
+// a record holds its name and the '\0', rounded up to keep records 4-byte aligned
+static uint16_t record_size(size_t name_len) {
+    return (offsetof(dir_record, name) + name_len + 1 + 3) & ~3u;
+}
+
+static dir_record* record_at(dir_bucket* b, size_t off) {
+    return (dir_record*)(b->records + off);
+}
+
+static void bucket_init(dir_bucket* b) {
+    memset(b, 0, sizeof *b);
+    record_at(b, 0)->rec_len = sizeof b->records;
+}
+
+/*
+Add a record for name to bucket b, in the first gap that fits it: the space after a record's name, or an unused
+first record. Returns the new record's offset, -1 if the bucket has no room.
+*/
+static int bucket_insert(dir_bucket* b, char const* name, int inum) {
+    size_t len = strlen(name);
+    uint16_t size = record_size(len);
+    for (size_t off = 0; off < sizeof b->records; off += record_at(b, off)->rec_len) {
+        dir_record* r = record_at(b, off);
+        uint16_t taken = r->name_len > 0 ? record_size(r->name_len) : 0;
+        if (r->rec_len - taken < size)
+            continue;
+        dir_record* rec = r;
+        if (taken > 0) {
+            rec = record_at(b, off + taken);
+            rec->rec_len = r->rec_len - taken;
+            r->rec_len = taken;
         }
+        rec->inode_num = inum;
+        rec->name_len = len;
+        memcpy(rec->name, name, len + 1);
+        ++(b->count);
+        b->used += size;
+        return (char*)rec - b->records;
     }
-    return dir_entry_count;
+    return -1;
 }
 
-static bool is_dir_empty(FSImage* my_fsi, int inum) {
-    return get_dir_entry_count(my_fsi, inum) == 2;
+/*
+Remove the record at off from bucket b, its space goes to the record before it. No other record moves, so the
+directory index only loses this one entry.
+*/
+static void bucket_remove(dir_bucket* b, size_t off) {
+    dir_record* r = record_at(b, off);
+    uint16_t rec_len = r->rec_len;
+    --(b->count);
+    b->used -= record_size(r->name_len);
+    memset(r, 0, rec_len);
+    if (off == 0) {
+        r->rec_len = rec_len;
+        return;
+    }
+    size_t prev = 0;
+    while (prev + record_at(b, prev)->rec_len < off)
+        prev += record_at(b, prev)->rec_len;
+    record_at(b, prev)->rec_len += rec_len;
+}
+
+// move the records of from into lo or hi, by bit level of their names' hashes
+static void bucket_split(dir_bucket* from, dir_bucket* lo, dir_bucket* hi, uint32_t level) {
+    for (size_t off = 0; off < sizeof from->records; off += record_at(from, off)->rec_len) {
+        dir_record* r = record_at(from, off);
+        if (r->name_len == 0)
+            continue;
+        int moved = bucket_insert(dir_name_hash(r->name) & level ? hi : lo, r->name, r->inode_num);
+        assert(moved > -1);
+    }
 }
 
 static int init_directory(FSImage* my_fsi, int inum, int pinum) {
-    // create new directory
-    dir_file new_dir = {
-        .d_entries = {
-            { .d_name = "." , .inode_num = inum  },
-            { .d_name = "..", .inode_num = pinum }
-        },
-        .d_count  = 2
-    };
-
-    // find empty block and copy directory into it
-    int blk_index = empty_block_index(my_fsi);
-    block* dest = &my_fsi->mfs->data_blocks[blk_index];
-    memcpy(dest, &new_dir, sizeof new_dir);
-
-    // update inode
-    inode* my_inode = &my_fsi->mfs->inode_table[inum];
+    // update inode, new directories are hashed
+    inode* my_inode = get_inode(my_fsi, inum);
     my_inode->type = I_DIRECTORY;
-    my_inode->size = get_dir_size(&new_dir);
-    my_inode->block_alloc_count = 1;
-    my_inode->block_ptrs[0] = dest;
+    my_inode->flags = INODE_DIR_HASHED;
+    my_inode->size = 2 * sizeof(dir_file_entry);
+
+    // find empty block and put . and .. into it
+    int blk_index = inode_map_block(my_fsi, inum, 0);
+    if (blk_index < 0)
+        return -1;
+    dir_bucket* bucket = &get_block(my_fsi, blk_index)->b_bucket;
+    bucket_init(bucket);
+    bucket_insert(bucket, ".", inum);
+    bucket_insert(bucket, "..", pinum);
+    mark_block_dirty(my_fsi, blk_index);
     return 0;
 }
 
-static void force_to_disk(FSImage* my_fsi) {
-    // write file system image to disk
-    char* mfs_ptr = (char*)(my_fsi->mfs);
-    size_t left_to_write = sizeof *(my_fsi->mfs);
-    while (left_to_write > 0) {
-        ssize_t written = write(my_fsi->fd, mfs_ptr, left_to_write);
+static void read_at(int fd, char* buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t bytes_read = pread(fd, buf, len, offset);
+        assert(bytes_read > 0);
+        buf += bytes_read;
+        offset += bytes_read;
+        len -= bytes_read;
+    }
+}
+
+static void write_at(int fd, char const* buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t written = pwrite(fd, buf, len, offset);
         assert(written > -1);
-        mfs_ptr += written;
-        left_to_write -= written;
+        buf += written;
+        offset += written;
+        len -= written;
     }
-    assert(left_to_write == 0);
-    lseek(my_fsi->fd, 0, SEEK_SET); // set file offset to point to beginning of file
-    fsync(my_fsi->fd); // force to disk
 }
 
-static int inode_get_free_block(FSImage* my_fsi, inode* in, bool* new_block) {
-    if (new_block)
-        *new_block = false;
+// where zone z starts in the image
+static uint64_t zone_offset(uint32_t z) {
+    return ZONES_OFFSET + (uint64_t)z * sizeof(SMFS_zone);
+}
 
-    if (in->type == I_DIRECTORY) {
-        // first check if any occupied blocks have space
-        for (int i=0; i< BLOCK_PTRS; i++) {
-            block* blkptr = in->block_ptrs[i];
-            if(blkptr != NULL && blkptr->b_directory.d_count != DENTRIES_MAX) {
-                return i;
-            }
-        }
-        // check for empty blocks
-        for (int i=0; i< BLOCK_PTRS; i++) {
-            if(in->block_ptrs[i] == NULL) {
-                if (new_block)
-                    *new_block = true;
-                return i;
-            }
+// memory holding image offset, which is in the superblock or in a zone in use
+static char* image_at(FSImage* my_fsi, uint64_t offset) {
+    if (offset < ZONES_OFFSET)
+        return (char*)(my_fsi->sb) + offset;
+    uint32_t z = (offset - ZONES_OFFSET) / sizeof(SMFS_zone);
+    return (char*)(my_fsi->zones[z]->disk) + (offset - zone_offset(z));
+}
+
+/*
+Write [offset, offset+len) of the image, which lies in the superblock or in one zone, from memory to the image
+file. Mapped images too: their mappings are private, so this is the only way changes reach the file, and only
+once they are in the durable log.
+*/
+static void write_back(FSImage* my_fsi, size_t offset, size_t len) {
+    write_at(my_fsi->fd, image_at(my_fsi, offset), len, offset);
+}
 
+typedef void (*region_fn)(FSImage* my_fsi, size_t offset, size_t len);
+
+/*
+Call fn for every dirty run of bitarray set in [0, count) whose items are item_size bytes and start at
+region_offset in the image. Adjacent dirty items are coalesced into one run. Clears the dirty bits.
+*/
+static void walk_dirty_region(FSImage* my_fsi, bitarray dirty, int count, size_t region_offset, size_t item_size, region_fn fn) {
+    int i = 0;
+    while (i < count) {
+        if (!test_bit(dirty, i)) {
+            ++i;
+            continue;
         }
-    } else if (in->type == I_FILE) {
-        // check for empty blocks
-        for (int i=0; i< BLOCK_PTRS; i++) {
-            if(in->block_ptrs[i] == NULL) {
-                if (new_block)
-                    *new_block = true;
-                return i;
-            }
+        int run_start = i;
+        while (i < count && test_bit(dirty, i)) {
+            clear_bit(dirty, i);
+            ++i;
         }
+        fn(my_fsi, region_offset + run_start * item_size, (i - run_start) * item_size);
     }
+}
 
-    // no free blocks
-    return -1;
+// dirty is a set of regions of zone z
+static void walk_dirty_set(FSImage* my_fsi, uint32_t z, dirty_set* dirty, region_fn fn) {
+    walk_dirty_region(my_fsi, dirty->alloc_words, 2 * ALLOC_WORDS, zone_offset(z) + offsetof(SMFS_zone, inode_alloc), sizeof(int32_t), fn);
+    walk_dirty_region(my_fsi, dirty->inodes, ZONE_INODES, zone_offset(z) + offsetof(SMFS_zone, inode_table), sizeof(inode), fn);
+    walk_dirty_region(my_fsi, dirty->blocks, ZONE_BLOCKS, zone_offset(z) + offsetof(SMFS_zone, data_blocks), sizeof(block), fn);
 }
 
-static bool is_valid_inum(int inum) {
-    if (inum > INODE_TABLE_SIZE-1 || inum < 0)
-        return false;
-    else
-        return true;
+static void merge_dirty_set(dirty_set* dest, dirty_set const* src) {
+    for (int i = 0; i < ALLOC_WORDS; i++) {
+        dest->alloc_words[i] |= src->alloc_words[i];
+        dest->inodes[i] |= src->inodes[i];
+        dest->blocks[i] |= src->blocks[i];
+    }
 }
 
-static bool is_valid_blknum(int blknum) {
-    if (blknum > BLOCK_COUNT-1 || blknum < 0)
-        return false;
-    else
-        return true;
+// next zone from z on whose bit is set in zones, -1 if there is none
+static int next_zone(bitarray zones, int z) {
+    for (; z < ZONES_MAX; z++) {
+        if (zones[z / ALLOC_WORD_BITS] == 0)
+            z |= ALLOC_WORD_BITS - 1; // skip the rest of an empty word
+        else if (test_bit(zones, z))
+            return z;
+    }
+    return -1;
 }
 
-static bool is_valid_blkoffset(int blknum) {
-    if (blknum > BLOCK_PTRS-1 || blknum < 0)
-        return false;
-    else
-        return true;
+static void force_to_disk(FSImage* my_fsi, uint32_t z, dirty_set* dirty) {
+    // write only the regions in the dirty set, at their own offsets in the image
+    walk_dirty_set(my_fsi, z, dirty, write_back);
+    fsync(my_fsi->fd); // force to disk
 }
 
-static bool is_valid_file_type(FSImage* my_fsi, int inum, i_type type) {
-    inode* my_inode = &my_fsi->mfs->inode_table[inum];
-    if (my_inode->type != type)
-        return false;
-    else
-        return true;
+static void log_region(FSImage* my_fsi, size_t offset, size_t len) {
+    journal_add(&my_fsi->log, offset, image_at(my_fsi, offset), len);
 }
 
-static int dir_find_inode(FSImage* my_fsi, int pinum, char const* name) {
-    inode* parent_inode = &my_fsi->mfs->inode_table[pinum];
-    for(int i=0; i<BLOCK_PTRS; i++) {
-        dir_file* dir = &parent_inode->block_ptrs[i]->b_directory;
-        if (dir != NULL) {
-            for(int j=0; j<dir->d_count; j++) {
-                dir_file_entry* entry = &dir->d_entries[j];
-                if (strcmp(entry->d_name, name) == 0) {
-                    int found_inum = entry->inode_num;
-                    return found_inum;
-                }
-            }
+/*
+Make every log record up to seq durable. The fdatasync runs without log_lock so operations keep appending
+meanwhile, and only one thread syncs at a time: the others wait for its result and sync again only if it
+didn't cover their record, so concurrent operations share fsyncs.
+*/
+static void sync_log(FSImage* my_fsi, uint64_t seq) {
+    pthread_mutex_lock(&my_fsi->log_lock);
+    while (my_fsi->synced_seq < seq) {
+        if (my_fsi->log_syncing) {
+            pthread_cond_wait(&my_fsi->log_synced_cv, &my_fsi->log_lock);
+            continue;
         }
+        my_fsi->log_syncing = true;
+        uint64_t target = my_fsi->log.seq;
+        pthread_mutex_unlock(&my_fsi->log_lock);
+        journal_sync(&my_fsi->log);
+        pthread_mutex_lock(&my_fsi->log_lock);
+        my_fsi->synced_seq = target;
+        my_fsi->log_syncing = false;
+        pthread_cond_broadcast(&my_fsi->log_synced_cv);
+    }
+    pthread_mutex_unlock(&my_fsi->log_lock);
+}
+
+static uint64_t last_logged_seq(FSImage* my_fsi) {
+    pthread_mutex_lock(&my_fsi->log_lock);
+    uint64_t seq = my_fsi->log.seq;
+    pthread_mutex_unlock(&my_fsi->log_lock);
+    return seq;
+}
+
+// write back every region logged so far, called with checkpoint_lock held exclusively; returns the log size it covers
+static off_t write_back_logged(FSImage* my_fsi) {
+    sync_log(my_fsi, last_logged_seq(my_fsi)); // logged before written back: the image never gets ahead of the durable log
+    for (int z = next_zone(my_fsi->unflushed_zones, 0); z > -1; z = next_zone(my_fsi->unflushed_zones, z + 1)) {
+        walk_dirty_set(my_fsi, z, &my_fsi->zones[z]->unflushed, write_back);
+        clear_bit(my_fsi->unflushed_zones, z);
+    }
+    return my_fsi->log.size;
+}
+
+/*
+Write back everything logged so far and truncate the log. Takes checkpoint_lock exclusively: mutations wait,
+lookups and reads carry on. The image fsync runs without the lock unless hold_lock is set, so mutations
+only wait for the log fsync and the pwrites. If records were appended meanwhile the log can't be
+truncated yet and false is returned.
+*/
+static bool checkpoint(FSImage* my_fsi, bool hold_lock) {
+    pthread_rwlock_wrlock(&my_fsi->checkpoint_lock);
+    off_t logged = write_back_logged(my_fsi);
+
+    if (!hold_lock)
+        pthread_rwlock_unlock(&my_fsi->checkpoint_lock);
+    fsync(my_fsi->fd);
+
+    pthread_mutex_lock(&my_fsi->log_lock);
+    bool reset = my_fsi->log.size == logged;
+    if (reset)
+        journal_reset(&my_fsi->log);
+    pthread_mutex_unlock(&my_fsi->log_lock);
+    if (hold_lock)
+        pthread_rwlock_unlock(&my_fsi->checkpoint_lock);
+    return reset;
+}
+
+static bool needs_zone(FSImage* my_fsi) {
+    return __atomic_load_n(&my_fsi->free_inodes, __ATOMIC_RELAXED) < GROW_FREE_MIN ||
+        __atomic_load_n(&my_fsi->free_blocks, __ATOMIC_RELAXED) < GROW_FREE_MIN;
+}
+
+/*
+Checkpoints once the log is big enough, and adds a zone when end_op() finds the volume nearly full, so
+operations rarely have to grow it themselves.
+*/
+static void* checkpointer_main(void* arg) {
+    FSImage* my_fsi = arg;
+    while (1) {
+        pthread_mutex_lock(&my_fsi->log_lock);
+        while (my_fsi->log.size < CHECKPOINT_LOG_BYTES && !my_fsi->grow_wanted)
+            pthread_cond_wait(&my_fsi->checkpoint_cv, &my_fsi->log_lock);
+        bool grow = my_fsi->grow_wanted;
+        bool full = my_fsi->log.size >= CHECKPOINT_LOG_BYTES;
+        pthread_mutex_unlock(&my_fsi->log_lock);
+
+        if (grow) {
+            pthread_mutex_lock(&my_fsi->block_alloc_lock);
+            if (needs_zone(my_fsi))
+                grow_volume(my_fsi, my_fsi->zone_count);
+            pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+            pthread_mutex_lock(&my_fsi->log_lock);
+            my_fsi->grow_wanted = false;
+            pthread_mutex_unlock(&my_fsi->log_lock);
+        }
+        // under constant load the log keeps growing during the unlocked fsync, the second pass guarantees progress
+        if (full && !checkpoint(my_fsi, false))
+            checkpoint(my_fsi, true);
+    }
+    return NULL;
+}
+
+/*
+Locking. Lookups, stats and reads lock the inodes they look at shared, one at a time. Mutations lock the
+inodes they change exclusively until their record is in the log, so operations on different files and
+directories run in parallel. A thread takes locks in this order:
+    checkpoint_lock     shared for the whole of every mutation, see begin_op()
+    inode_locks         ascending stripe order, see lock_inodes()
+    dirs_lock           only inside the dir index helpers
+    inode_alloc_lock
+    block_alloc_lock    reclaim_preallocations() only tries inode locks while holding it, grow_volume() needs it
+    log_lock
+replies_lock is only held around reply cache lookups and updates, never together with another lock.
+An inode's lock also covers the data blocks it maps, its preallocation window and its dir index entries.
+create_file() reserves its new inode before locking anything, so it can lock it together with the parent.
+*/
+
+static pthread_rwlock_t* inode_lock(FSImage* my_fsi, int inum) {
+    return &my_fsi->inode_locks[inum % INODE_LOCK_STRIPES];
+}
+
+static bool holds_inode(int inum) {
+    return op.locked & (1ull << (inum % INODE_LOCK_STRIPES));
+}
+
+/*
+Lock inodes a and b (-1 for none) exclusively until end_op(). Called with no inode locks held, an operation
+that needs another inode later has to unlock_inodes() and take them all again.
+*/
+static void lock_inodes(FSImage* my_fsi, int a, int b) {
+    assert(op.locked == 0);
+    int first = a % INODE_LOCK_STRIPES;
+    int second = b < 0 ? first : b % INODE_LOCK_STRIPES;
+    if (second < first) {
+        int tmp = first;
+        first = second;
+        second = tmp;
+    }
+    pthread_rwlock_wrlock(&my_fsi->inode_locks[first]);
+    if (second != first)
+        pthread_rwlock_wrlock(&my_fsi->inode_locks[second]);
+    op.locked = (1ull << first) | (1ull << second);
+}
+
+static void unlock_inodes(FSImage* my_fsi) {
+    for (int stripe = 0; stripe < INODE_LOCK_STRIPES; stripe++) {
+        if (op.locked & (1ull << stripe))
+            pthread_rwlock_unlock(&my_fsi->inode_locks[stripe]);
+    }
+    op.locked = 0;
+}
+
+/*
+Hand the operation's freed blocks and inodes in zone z to the allocator and mark the bitmap words they clear
+dirty, so they go into the operation's record. Called by end_op() with the alloc locks held.
+*/
+static void release_freed(FSImage* my_fsi, uint32_t z) {
+    op_zone* oz = op.zones[z];
+    zone* zn = my_fsi->zones[z];
+    for (int i = 0; i < ZONE_INODES; i++) {
+        if (test_bit(oz->freed_inodes, i)) {
+            clear_bit(oz->freed_inodes, i);
+            release_bit(zn->disk->inode_alloc, i, &zn->inode_hint);
+            set_bit(oz->dirty.alloc_words, i / ALLOC_WORD_BITS);
+            __atomic_fetch_add(&my_fsi->free_inodes, 1, __ATOMIC_RELAXED);
+        }
+    }
+    for (int i = 0; i < ZONE_BLOCKS; i++) {
+        if (test_bit(oz->freed_blocks, i)) {
+            clear_bit(oz->freed_blocks, i);
+            release_bit(zn->disk->block_alloc, i, &zn->block_hint);
+            set_bit(oz->dirty.alloc_words, ALLOC_WORDS + i / ALLOC_WORD_BITS);
+            __atomic_fetch_add(&my_fsi->free_blocks, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void begin_op(FSImage* my_fsi) {
+    pthread_rwlock_rdlock(&my_fsi->checkpoint_lock);
+}
+
+/*
+Append everything the operation modified to the log as one record. The record is durable once this
+returns, unless a group is open, in which case SMFS_end_group() syncs all of the group's records at once.
+All locks are released before waiting for the log fsync, so other operations don't wait for the disk.
+Freed blocks and inodes are released while the alloc locks are held, so the record carries the cleared
+bitmap bits and no other operation can reuse them before it is logged.
+*/
+static void end_op(FSImage* my_fsi) {
+    // bitmap words are copied into the record, so no allocation may be half way through one
+    pthread_mutex_lock(&my_fsi->inode_alloc_lock);
+    pthread_mutex_lock(&my_fsi->block_alloc_lock);
+    pthread_mutex_lock(&my_fsi->log_lock);
+    journal_begin(&my_fsi->log);
+    for (int z = next_zone(op.touched, 0); z > -1; z = next_zone(op.touched, z + 1)) {
+        if (op.freed)
+            release_freed(my_fsi, z);
+        merge_dirty_set(&my_fsi->zones[z]->unflushed, &op.zones[z]->dirty);
+        set_bit(my_fsi->unflushed_zones, z);
+        walk_dirty_set(my_fsi, z, &op.zones[z]->dirty, log_region);
+        clear_bit(op.touched, z);
+    }
+    journal_end(&my_fsi->log);
+    uint64_t seq = my_fsi->log.seq;
+    op.freed = false;
+    if (!my_fsi->grow_wanted && my_fsi->zone_count < my_fsi->zones_max && needs_zone(my_fsi))
+        my_fsi->grow_wanted = true;
+    if (my_fsi->log.size >= CHECKPOINT_LOG_BYTES || my_fsi->grow_wanted)
+        pthread_cond_signal(&my_fsi->checkpoint_cv);
+    pthread_mutex_unlock(&my_fsi->log_lock);
+    pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+    pthread_mutex_unlock(&my_fsi->inode_alloc_lock);
+    unlock_inodes(my_fsi);
+    pthread_rwlock_unlock(&my_fsi->checkpoint_lock);
+    if (group_depth == 0)
+        sync_log(my_fsi, seq);
+}
+
+/*
+Group commit: operations between SMFS_begin_group() and SMFS_end_group() share a single log fsync.
+Their results must not be reported to clients before SMFS_end_group() returns. A group belongs to the
+thread that opened it, groups of different threads overlap freely.
+*/
+void SMFS_begin_group(FSImage* my_fsi) {
+    ++group_depth;
+}
+
+void SMFS_end_group(FSImage* my_fsi) {
+    if (--group_depth == 0)
+        sync_log(my_fsi, last_logged_seq(my_fsi));
+}
+
+/*
+Find the inode's file block that can take more data. Directory blocks [0, block_alloc_count) are in use,
+so a new block always goes at file block block_alloc_count.
+*/
+static int inode_get_free_block(FSImage* my_fsi, inode* in, bool* new_block) {
+    if (new_block)
+        *new_block = false;
+
+    if (in->type == I_DIRECTORY) {
+        // first check if any occupied blocks have space
+        for (int i=0; i< in->block_alloc_count; i++) {
+            if(get_block(my_fsi, inode_lookup_block(my_fsi, in, i))->b_directory.d_count != DENTRIES_MAX) {
+                return i;
+            }
+        }
+    }
+
+    if (in->type == I_DIRECTORY || in->type == I_FILE) {
+        // check for empty blocks
+        if (in->block_alloc_count < BLOCK_PTRS) {
+            if (new_block)
+                *new_block = true;
+            return in->block_alloc_count;
+        }
+    }
+
+    // no free blocks
+    return -1;
+}
+
+static bool is_valid_inum(FSImage* my_fsi, int inum) {
+    if (inum < 0 || (uint32_t)inum >= zone_count(my_fsi) * ZONE_INODES)
+        return false;
+    else
+        return true;
+}
+
+static bool is_valid_blkoffset(int blknum) {
+    if (blknum > FILE_BLOCKS_MAX-1 || blknum < 0)
+        return false;
+    else
+        return true;
+}
+
+static bool is_valid_file_type(FSImage* my_fsi, int inum, i_type type) {
+    inode* my_inode = get_inode(my_fsi, inum);
+    if (my_inode->type != type)
+        return false;
+    else
+        return true;
+}
+
+/*
+The index is shared by all directories: searches hold dirs_lock shared, changes hold it exclusively. Entries of
+directory pinum only change while pinum is locked exclusively, so its lock keeps them valid between the two.
+*/
+
+// put the records of bucket lblk of hashed directory pinum into the index, called with dirs_lock held exclusively
+static void index_bucket(dir_index* idx, int pinum, dir_bucket* b, uint32_t lblk) {
+    for (size_t off = 0; off < sizeof b->records; off += record_at(b, off)->rec_len) {
+        dir_record* r = record_at(b, off);
+        if (r->name_len > 0)
+            dir_index_insert(idx, pinum, r->name, r->inode_num, lblk, off);
+    }
+}
+
+// take the records of a bucket of hashed directory pinum out of the index, called with dirs_lock held exclusively
+static void unindex_bucket(dir_index* idx, int pinum, dir_bucket* b) {
+    for (size_t off = 0; off < sizeof b->records; off += record_at(b, off)->rec_len) {
+        dir_record* r = record_at(b, off);
+        if (r->name_len > 0)
+            dir_index_remove(idx, dir_index_find(idx, pinum, r->name));
+    }
+}
+
+/*
+Put every entry of directory pinum into the index, done by its first lookup. Called with pinum locked: its entries
+can't change meanwhile, and concurrent lookups that both find it missing load it only once.
+*/
+static void load_dir_index(FSImage* my_fsi, int pinum) {
+    dir_index* idx = &my_fsi->dirs;
+    pthread_rwlock_wrlock(&my_fsi->dirs_lock);
+    if (dir_index_loaded(idx, pinum)) {
+        pthread_rwlock_unlock(&my_fsi->dirs_lock);
+        return;
+    }
+    inode* parent_inode = get_inode(my_fsi, pinum);
+    for(int i=0; i<parent_inode->block_alloc_count; i++) {
+        block* blk = get_block(my_fsi, inode_lookup_block(my_fsi, parent_inode, i));
+        if (is_hashed_dir(parent_inode)) {
+            index_bucket(idx, pinum, &blk->b_bucket, i);
+            continue;
+        }
+        dir_file* dir = &blk->b_directory;
+        for(int j=0; j<dir->d_count; j++) {
+            dir_file_entry* entry = &dir->d_entries[j];
+            dir_index_insert(idx, pinum, entry->d_name, entry->inode_num, i, j);
+        }
+    }
+    dir_index_set_loaded(idx, pinum, true);
+    pthread_rwlock_unlock(&my_fsi->dirs_lock);
+}
+
+/*
+Forget directory inum before its blocks are freed. Only "." and ".." are left in a directory that can be unlinked.
+*/
+static void drop_dir_index(FSImage* my_fsi, int inum) {
+    dir_index* idx = &my_fsi->dirs;
+    pthread_rwlock_wrlock(&my_fsi->dirs_lock);
+    if (dir_index_loaded(idx, inum)) {
+        char const* names[] = { ".", ".." };
+        for (int i=0; i<2; i++) {
+            dir_index_entry* entry = dir_index_find(idx, inum, names[i]);
+            if (entry)
+                dir_index_remove(idx, entry);
+        }
+        dir_index_set_loaded(idx, inum, false);
+    }
+    pthread_rwlock_unlock(&my_fsi->dirs_lock);
+}
+
+/*
+Legacy directory file blocks from lblk on have moved down one after a block was collapsed, update their entries.
+*/
+static void renumber_dir_index(FSImage* my_fsi, int pinum, uint32_t lblk) {
+    dir_index* idx = &my_fsi->dirs;
+    pthread_rwlock_wrlock(&my_fsi->dirs_lock);
+    if (dir_index_loaded(idx, pinum)) {
+        inode* parent_inode = get_inode(my_fsi, pinum);
+        for(uint32_t i=lblk; i<parent_inode->block_alloc_count; i++) {
+            dir_file* dir = &get_block(my_fsi, inode_lookup_block(my_fsi, parent_inode, i))->b_directory;
+            for(int j=0; j<dir->d_count; j++)
+                dir_index_find(idx, pinum, dir->d_entries[j].d_name)->lblk = i;
+        }
+    }
+    pthread_rwlock_unlock(&my_fsi->dirs_lock);
+}
+
+// copy of the index entry for name in directory pinum, false if there is none. Called with pinum locked.
+static bool find_dir_entry(FSImage* my_fsi, int pinum, char const* name, dir_index_entry* found) {
+    pthread_rwlock_rdlock(&my_fsi->dirs_lock);
+    if (!dir_index_loaded(&my_fsi->dirs, pinum)) {
+        pthread_rwlock_unlock(&my_fsi->dirs_lock);
+        load_dir_index(my_fsi, pinum);
+        pthread_rwlock_rdlock(&my_fsi->dirs_lock);
+    }
+    dir_index_entry* entry = dir_index_find(&my_fsi->dirs, pinum, name);
+    if (entry)
+        *found = *entry;
+    pthread_rwlock_unlock(&my_fsi->dirs_lock);
+    return entry != NULL;
+}
+
+// where a directory entry lives, filled in by dir_seek()
+typedef struct dir_cursor_ {
+    uint32_t        lblk;   // directory file block
+    uint32_t        blknum; // data block
+    int             slot;   // index into d_entries, or offset of the record in a bucket
+    dir_file*       dir;    // legacy directories
+    dir_file_entry* entry;
+    dir_record*     record; // hashed directories
+} dir_cursor;
+
+/*
+Find name in directory pinum and return its inode number, -1 if it isn't there. When cursor is given it is
+pointed at the entry. Only the block holding the entry is touched. Called with pinum locked.
+*/
+static int dir_seek(FSImage* my_fsi, int pinum, char const* name, dir_cursor* cursor) {
+    dir_index_entry found;
+    if (!find_dir_entry(my_fsi, pinum, name, &found))
+        return -1;
+    if (cursor) {
+        inode* parent_inode = get_inode(my_fsi, pinum);
+        cursor->lblk   = found.lblk;
+        cursor->blknum = inode_lookup_block(my_fsi, parent_inode, found.lblk);
+        cursor->slot   = found.slot;
+        block* blk = get_block(my_fsi, cursor->blknum);
+        if (is_hashed_dir(parent_inode)) {
+            cursor->dir    = NULL;
+            cursor->entry  = NULL;
+            cursor->record = record_at(&blk->b_bucket, found.slot);
+        } else {
+            cursor->dir    = &blk->b_directory;
+            cursor->entry  = &cursor->dir->d_entries[found.slot];
+            cursor->record = NULL;
+        }
+    }
+    return found.inum;
+}
+
+static dir_file_entry* add_dir_entry(FSImage* my_fsi, int pinum, int lblk, dir_file* dir, int inum, char const* filename) {
+    // is space in current dir file ?
+    if (dir->d_count < DENTRIES_MAX) {
+        int slot = dir->d_count;
+        dir_file_entry* new_entry = &dir->d_entries[slot];
+        new_entry->inode_num = inum;
+        strcpy(new_entry->d_name, filename);
+        ++(dir->d_count); // update directory count
+        pthread_rwlock_wrlock(&my_fsi->dirs_lock);
+        if (dir_index_loaded(&my_fsi->dirs, pinum))
+            dir_index_insert(&my_fsi->dirs, pinum, new_entry->d_name, inum, lblk, slot);
+        pthread_rwlock_unlock(&my_fsi->dirs_lock);
+        return new_entry;
+    }
+    printf("dir count = %d\n",dir->d_count);
+    fprintf(stderr, "ERROR: add_dir_entry() failure. THIS SHOULD NEVER HAPPEN, SOMETHING IS WRONG\n");
+    return NULL;
+
+}
+
+/*
+Remove the entry under cursor from its directory block, filling the hole with the block's last entry.
+Returns the removed entry's inode number.
+*/
+static int remove_dir_entry(FSImage* my_fsi, int pinum, dir_cursor const* cursor) {
+    dir_file* dir = cursor->dir;
+    dir_file_entry* found = cursor->entry;
+    int deleted_entry_inum = found->inode_num;
+
+    dir_index* idx = &my_fsi->dirs;
+    pthread_rwlock_wrlock(&my_fsi->dirs_lock);
+    bool indexed = dir_index_loaded(idx, pinum);
+    if (indexed)
+        dir_index_remove(idx, dir_index_find(idx, pinum, found->d_name));
+    
+    // if file is last entry in dir file
+    if (cursor->slot == (dir->d_count)-1) {
+        memset(found, 0, sizeof *found); // reset file entry
+        --(dir->d_count);
+        pthread_rwlock_unlock(&my_fsi->dirs_lock);
+        return deleted_entry_inum;
+    }
+
+    // copy last element into the deleted dir entry's location
+    dir_file_entry* last = &dir->d_entries[dir->d_count -1];
+    dir_index_entry* moved = indexed ? dir_index_find(idx, pinum, last->d_name) : NULL;
+    memcpy(found, last, sizeof *found);
+    memset(last, 0, sizeof *found);
+    --(dir->d_count);
+    if (moved) {
+        moved->name = found->d_name;
+        moved->slot = cursor->slot;
+    }
+    pthread_rwlock_unlock(&my_fsi->dirs_lock);
+    return deleted_entry_inum;
+}
+
+/*
+Add bucket n to hashed directory pinum of n buckets and split bucket n - level into it. Returns -1 if the volume
+is full or the directory has DIR_BUCKETS_MAX buckets. Called with pinum locked.
+*/
+static int split_bucket(FSImage* my_fsi, int pinum) {
+    inode* parent_inode = get_inode(my_fsi, pinum);
+    uint32_t n = parent_inode->block_alloc_count;
+    if (n >= DIR_BUCKETS_MAX)
+        return -1;
+    pthread_mutex_lock(&my_fsi->block_alloc_lock);
+    int blknum = inode_map_block(my_fsi, pinum, n);
+    pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+    if (blknum < 0)
+        return -1;
+
+    uint32_t level = bucket_level(n);
+    uint32_t from = n - level;
+    int from_blknum = inode_lookup_block(my_fsi, parent_inode, from);
+    dir_bucket* lo = &get_block(my_fsi, from_blknum)->b_bucket;
+    dir_bucket* hi = &get_block(my_fsi, blknum)->b_bucket;
+    dir_bucket old = *lo;
+
+    dir_index* idx = &my_fsi->dirs;
+    pthread_rwlock_wrlock(&my_fsi->dirs_lock);
+    bool indexed = dir_index_loaded(idx, pinum);
+    if (indexed)
+        unindex_bucket(idx, pinum, lo);
+    bucket_init(lo);
+    bucket_init(hi);
+    bucket_split(&old, lo, hi, level);
+    if (indexed) {
+        index_bucket(idx, pinum, lo, from);
+        index_bucket(idx, pinum, hi, n);
+    }
+    pthread_rwlock_unlock(&my_fsi->dirs_lock);
+    mark_block_dirty(my_fsi, from_blknum);
+    mark_block_dirty(my_fsi, blknum);
+    return 0;
+}
+
+/*
+Add filename to hashed directory pinum. An insert that leaves its bucket fuller than DIR_SPLIT_USED splits the
+next bucket in turn, one that finds its bucket full splits buckets until it has room. Returns -1 if the
+directory can't grow. Called with pinum locked.
+*/
+static int add_hashed_entry(FSImage* my_fsi, int pinum, int inum, char const* filename) {
+    inode* parent_inode = get_inode(my_fsi, pinum);
+    uint32_t hash = dir_name_hash(filename);
+    while (1) {
+        uint32_t lblk = dir_bucket_of(hash, parent_inode->block_alloc_count);
+        int blknum = inode_lookup_block(my_fsi, parent_inode, lblk);
+        dir_bucket* bucket = &get_block(my_fsi, blknum)->b_bucket;
+        int off = bucket_insert(bucket, filename, inum);
+        if (off > -1) {
+            mark_block_dirty(my_fsi, blknum);
+            pthread_rwlock_wrlock(&my_fsi->dirs_lock);
+            if (dir_index_loaded(&my_fsi->dirs, pinum))
+                dir_index_insert(&my_fsi->dirs, pinum, record_at(bucket, off)->name, inum, lblk, off);
+            pthread_rwlock_unlock(&my_fsi->dirs_lock);
+            if (bucket->used > DIR_SPLIT_USED)
+                split_bucket(my_fsi, pinum); // only keeps buckets from filling up, the entry is in
+            return 0;
+        }
+        if (split_bucket(my_fsi, pinum) < 0) {
+            fprintf(stderr, "ERROR: (SMFS_create_file) directory inode %d has no room for '%s'\n", pinum, filename);
+            return -1;
+        }
+    }
+}
+
+/*
+Remove the record under cursor from its bucket, the bucket's other records stay where they are. Returns the
+removed entry's inode number.
+*/
+static int remove_hashed_entry(FSImage* my_fsi, int pinum, dir_cursor const* cursor) {
+    dir_record* found = cursor->record;
+    int deleted_entry_inum = found->inode_num;
+
+    dir_index* idx = &my_fsi->dirs;
+    pthread_rwlock_wrlock(&my_fsi->dirs_lock);
+    if (dir_index_loaded(idx, pinum))
+        dir_index_remove(idx, dir_index_find(idx, pinum, found->name));
+    bucket_remove(&get_block(my_fsi, cursor->blknum)->b_bucket, cursor->slot);
+    pthread_rwlock_unlock(&my_fsi->dirs_lock);
+    return deleted_entry_inum;
+}
+
+/*
+Map or read [offset, offset+len) of the image file into memory that never moves, NULL on failure.
+FSI_MMAP maps the file MAP_PRIVATE so pages load on demand, and the ones an operation changes become private
+copies: the kernel never writes them back to the file behind the log, write_back() does once they are logged.
+FSI_BUFFERED reads it into a private heap buffer.
+*/
+static void* load_region(FSImage* my_fsi, uint64_t offset, size_t len) {
+    if (my_fsi->mode == FSI_MMAP) {
+        size_t page_delta = offset % sysconf(_SC_PAGESIZE);
+        char* addr = mmap(NULL, len + page_delta, PROT_READ | PROT_WRITE, MAP_PRIVATE, my_fsi->fd, offset - page_delta);
+        if (addr == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+        return addr + page_delta;
+    }
+
+    char* readbuf = malloc(len);
+    if (readbuf == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    // read file contents into buffer, positional reads leave the file offset untouched
+    read_at(my_fsi->fd, readbuf, len, offset);
+    return readbuf;
+}
+
+static void unload_region(FSImage* my_fsi, void* addr, size_t len) {
+    if (my_fsi->mode == FSI_MMAP) {
+        size_t page_delta = (uintptr_t)addr % sysconf(_SC_PAGESIZE);
+        munmap((char*)addr - page_delta, len + page_delta);
+    } else {
+        free(addr);
+    }
+}
+
+static zone* load_zone(FSImage* my_fsi, uint32_t z) {
+    zone* zn = calloc(1, sizeof *zn);
+    assert(zn != NULL);
+    zn->disk = load_region(my_fsi, zone_offset(z), sizeof(SMFS_zone));
+    if (zn->disk == NULL) {
+        free(zn);
+        return NULL;
+    }
+    init_hint(zn->disk->inode_alloc, ZONE_INODES, &zn->inode_hint);
+    init_hint(zn->disk->block_alloc, ZONE_BLOCKS, &zn->block_hint);
+    return zn;
+}
+
+/*
+Add a zone to the end of the volume, unless it already has more than seen zones (another thread grew it
+meanwhile). The longer file is made durable before the superblock counts the new zone, and operations only
+allocate from it once the superblock is durable too: a crash in between leaves unused space at the end of
+the file, which the next open cuts off. Returns 0 if the volume has more than seen zones, -1 if it can't
+grow. Called with block_alloc_lock held, or before the image is shared.
+*/
+static int grow_volume(FSImage* my_fsi, uint32_t seen) {
+    uint32_t z = my_fsi->zone_count;
+    if (z > seen)
+        return 0;
+    if (z >= my_fsi->zones_max) {
+        fprintf(stderr, "ERROR: (grow_volume) file system is at its maximum of %u zones\n", my_fsi->zones_max);
+        return -1;
+    }
+    zone* zn = NULL;
+    if (ftruncate(my_fsi->fd, zone_offset(z + 1)) < 0 || (zn = load_zone(my_fsi, z)) == NULL) {
+        fprintf(stderr, "ERROR: (grow_volume) can't add zone %u: %s\n", z, strerror(errno));
+        int rc = ftruncate(my_fsi->fd, zone_offset(z));
+        assert(rc == 0);
+        my_fsi->zones_max = z; // rather than failing again on every operation
+        return -1;
+    }
+    fsync(my_fsi->fd);
+
+    my_fsi->zones[z] = zn;
+    superblock* sb = my_fsi->sb;
+    sb->zone_count = z + 1;
+    sb->inode_count = sb->zone_count * ZONE_INODES;
+    sb->block_count = sb->zone_count * ZONE_BLOCKS;
+    write_back(my_fsi, 0, sizeof *sb);
+    fsync(my_fsi->fd);
+
+    __atomic_fetch_add(&my_fsi->free_inodes, zn->inode_hint.free, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&my_fsi->free_blocks, zn->block_hint.free, __ATOMIC_RELAXED);
+    __atomic_store_n(&my_fsi->zone_count, z + 1, __ATOMIC_RELEASE);
+    if (z > 0)
+        printf("SERVER:: file system grew to %u zones (%u inodes, %u blocks)\n", sb->zone_count, sb->inode_count, sb->block_count);
+    return 0;
+}
+
+/*
+Add zones to the volume ahead of need, zones = 0 only reports the size. Returns the number of zones the volume
+has, -1 if not all of them could be added.
+*/
+int SMFS_grow(FSImage* my_fsi, int zones) {
+    if (zones < 0) {
+        fprintf(stderr, "ERROR: (SMFS_grow) invalid zone count %d\n", zones);
+        return -1;
+    }
+    pthread_mutex_lock(&my_fsi->block_alloc_lock);
+    int rc = 0;
+    for (int i = 0; i < zones && rc == 0; i++)
+        rc = grow_volume(my_fsi, my_fsi->zone_count);
+    int count = my_fsi->zone_count;
+    pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+    return rc < 0 ? -1 : count;
+}
+
+// Stop the volume from growing past zones zones. It never shrinks, a smaller limit keeps it at its current size.
+void SMFS_set_max_zones(FSImage* my_fsi, uint32_t zones) {
+    pthread_mutex_lock(&my_fsi->block_alloc_lock);
+    if (zones > ZONES_MAX)
+        zones = ZONES_MAX;
+    my_fsi->zones_max = zones < my_fsi->zone_count ? my_fsi->zone_count : zones;
+    pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+}
+
+/*
+Initialize file system image to include an empty root directory with . and .. entries.
+my_fsi->sb must point at a zeroed superblock of an image without zones, the first zone is added here.
+*/
+int SMFS_init_file_system_image(FSImage* my_fsi) {
+    superblock* sb = my_fsi->sb;
+    sb->magic = SMFS_MAGIC;
+    sb->version = SMFS_VERSION;
+    sb->zone_inodes = ZONE_INODES;
+    sb->zone_blocks = ZONE_BLOCKS;
+    if (grow_volume(my_fsi, 0) < 0) // writes the superblock
+        return -1;
+
+    // init root directory
+    int root_inum = 0;
+    zone* zn = my_fsi->zones[0];
+    init_directory(my_fsi, root_inum, root_inum); // inum + parent inum are the same for root dir
+    set_bit(zn->disk->inode_alloc, root_inum); // update allocated inode bitarray
+    --(zn->inode_hint.free);
+    --(my_fsi->free_inodes);
+    mark_inode_alloc_dirty(my_fsi, root_inum);
+
+    // write file system image to disk, the rest of the (sparse) file already reads back as zeros
+    force_to_disk(my_fsi, 0, &op.zones[0]->dirty);
+    clear_bit(op.touched, 0);
+    return 0;
+}
+
+/*
+Version 1 -> 2: raw block* in inodes become block numbers.
+The pointers are only meaningful relative to the data_blocks address of the process that wrote them.
+The root directory was given data block 0 when the image was created, so its first pointer recovers that
+base (stride is sizeof(block), not BLOCK_SIZE). Pointers written after the image was reopened at another
+address can't be mapped back and are dropped.
+*/
+static void upgrade_v1(SMFS_v1 const* old, SMFS_v2* new) {
+    memcpy(new->inode_alloc, old->inode_alloc, sizeof new->inode_alloc);
+    memcpy(new->block_alloc, old->block_alloc, sizeof new->block_alloc);
+    memcpy(new->data_blocks, old->data_blocks, sizeof new->data_blocks);
+
+    uint64_t base = old->inode_table[0].block_ptrs[0];
+    for (int inum = 0; inum < INODE_TABLE_SIZE; inum++) {
+        inode_v1 const* old_inode = &old->inode_table[inum];
+        inode_v2* new_inode = &new->inode_table[inum];
+        if (!test_bit((int32_t*)old->inode_alloc, inum) || old_inode->type == I_EMPTY)
+            continue;
+
+        new_inode->type = old_inode->type;
+        for (int i = 0; i < old_inode->block_alloc_count && i < BLOCK_PTRS; i++) {
+            uint64_t ptr = old_inode->block_ptrs[i];
+            uint64_t blknum = (ptr - base) / sizeof(block);
+            if (ptr < base || (ptr - base) % sizeof(block) != 0 || blknum >= BLOCK_COUNT) {
+                fprintf(stderr, "ERROR: (upgrade_v1) dropping unmappable block %d of inode %d\n", i, inum);
+                continue;
+            }
+            set_bit(new->block_alloc, blknum); // version 1 SMFS_write_block never marked its blocks allocated
+            new_inode->block_nums[new_inode->block_alloc_count++] = blknum;
+        }
+
+        // sizes follow from what survived the conversion
+        if (new_inode->type == I_DIRECTORY) {
+            for (int i = 0; i < new_inode->block_alloc_count; i++)
+                new_inode->size += get_dir_size(&new->data_blocks[new_inode->block_nums[i]].b_directory);
+        } else {
+            new_inode->size = new_inode->block_alloc_count * BLOCK_SIZE;
+        }
+    }
+}
+
+// Version 2 -> 4: block_nums[] become extents, block i of the old list is file block i
+static void upgrade_v2(SMFS_v2 const* old, SMFS_v4* new) {
+    memcpy(new->inode_alloc, old->inode_alloc, sizeof new->inode_alloc);
+    memcpy(new->block_alloc, old->block_alloc, sizeof new->block_alloc);
+    memcpy(new->data_blocks, old->data_blocks, sizeof new->data_blocks);
+
+    for (int inum = 0; inum < INODE_TABLE_SIZE; inum++) {
+        inode_v2 const* old_inode = &old->inode_table[inum];
+        inode* new_inode = &new->inode_table[inum];
+        new_inode->type = old_inode->type;
+        new_inode->size = old_inode->size;
+        for (int i = 0; i < old_inode->block_alloc_count && i < BLOCK_PTRS; i++) {
+            insert_extent(new_inode->extents, &new_inode->extent_count, EXTENTS_MAX, i, old_inode->block_nums[i]);
+            ++(new_inode->block_alloc_count);
+        }
+    }
+}
+
+// Version 3 -> 4: the size is widened, the extents stay in the inode
+static void upgrade_v3(SMFS_v3 const* old, SMFS_v4* new) {
+    memcpy(new->inode_alloc, old->inode_alloc, sizeof new->inode_alloc);
+    memcpy(new->block_alloc, old->block_alloc, sizeof new->block_alloc);
+    memcpy(new->data_blocks, old->data_blocks, sizeof new->data_blocks);
+
+    for (int inum = 0; inum < INODE_TABLE_SIZE; inum++) {
+        inode_v3 const* old_inode = &old->inode_table[inum];
+        inode* new_inode = &new->inode_table[inum];
+        new_inode->type = old_inode->type;
+        new_inode->size = old_inode->size;
+        new_inode->block_alloc_count = old_inode->block_alloc_count;
+        new_inode->extent_count = old_inode->extent_count;
+        new_inode->prealloc_length = old_inode->prealloc_length;
+        new_inode->prealloc_start = old_inode->prealloc_start;
+        memcpy(new_inode->extents, old_inode->extents, sizeof new_inode->extents);
+    }
+}
+
+// Version 4 -> 5: the bitmaps, inodes and blocks become zone 0, inode and block numbers don't change
+static void upgrade_v4(SMFS_v4 const* old, superblock* sb, SMFS_zone* zone) {
+    sb->magic = SMFS_MAGIC;
+    sb->version = SMFS_VERSION;
+    sb->inode_count = ZONE_INODES;
+    sb->block_count = ZONE_BLOCKS;
+    sb->zone_inodes = ZONE_INODES;
+    sb->zone_blocks = ZONE_BLOCKS;
+    sb->zone_count = 1;
+    memcpy(zone->inode_alloc, old->inode_alloc, sizeof zone->inode_alloc);
+    memcpy(zone->block_alloc, old->block_alloc, sizeof zone->block_alloc);
+    memcpy(zone->inode_table, old->inode_table, sizeof zone->inode_table);
+    memcpy(zone->data_blocks, old->data_blocks, sizeof zone->data_blocks);
+}
+
+static void replay_region_into_file(void* ctx, uint64_t offset, char const* data, uint32_t length) {
+    write_at(*(int*)ctx, data, length, offset);
+}
+
+/*
+Log records hold offsets in the layout of the version that wrote them, so an old image has to be brought
+up to date with its log before it is converted.
+*/
+static void replay_old_log(char const* fsi, int old_fd) {
+    char log_filename[strlen(fsi) + 6]; // ".mfsj" extension + '\0'
+    strcpy(log_filename, fsi);
+    strcat(log_filename, ".mfsj");
+    if (access(log_filename, F_OK) != 0)
+        return;
+
+    journal log;
+    if (journal_open(&log, log_filename) < 0)
+        return;
+    if (log.size > 0) {
+        int replayed = journal_replay(&log, replay_region_into_file, &old_fd);
+        printf("SERVER:: replayed %d log records from '%s' before conversion\n", replayed, log_filename);
+        fsync(old_fd);
+        journal_reset(&log);
+    }
+    close(log.fd);
+    free(log.buf);
+}
+
+/*
+One-time conversion of an image written by an older version to the current format, one version step at
+a time. The converted image is written next to the old one and renamed over it.
+*/
+static int convert_image(char const* fsi_filename, int old_fd, uint32_t version) {
+    printf("SERVER:: converting version %u file system image '%s' to version %d\n", version, fsi_filename, SMFS_VERSION);
+    SMFS_v4* v4 = calloc(1, sizeof *v4);
+    assert(v4 != NULL);
+    if (version == 4) {
+        read_at(old_fd, (char*)v4, sizeof *v4, 0);
+    } else if (version == 3) {
+        SMFS_v3* v3 = malloc(sizeof *v3);
+        assert(v3 != NULL);
+        read_at(old_fd, (char*)v3, sizeof *v3, 0);
+        upgrade_v3(v3, v4);
+        free(v3);
+    } else {
+        SMFS_v2* v2 = calloc(1, sizeof *v2);
+        assert(v2 != NULL);
+        if (version == 1) {
+            SMFS_v1* v1 = malloc(sizeof *v1);
+            assert(v1 != NULL);
+            read_at(old_fd, (char*)v1, sizeof *v1, 0);
+            upgrade_v1(v1, v2);
+            free(v1);
+        } else {
+            read_at(old_fd, (char*)v2, sizeof *v2, 0);
+        }
+        upgrade_v2(v2, v4);
+        free(v2);
+    }
+    superblock* sb = calloc(1, ZONES_OFFSET);
+    SMFS_zone* zone = calloc(1, sizeof *zone);
+    assert(sb != NULL && zone != NULL);
+    upgrade_v4(v4, sb, zone);
+    free(v4);
+
+    char tmp_filename[strlen(fsi_filename) + 5];
+    strcpy(tmp_filename, fsi_filename);
+    strcat(tmp_filename, ".tmp");
+    int new_fd = open(tmp_filename, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    assert(new_fd > -1);
+    write_at(new_fd, (char const*)sb, ZONES_OFFSET, 0);
+    write_at(new_fd, (char const*)zone, sizeof *zone, zone_offset(0));
+    fsync(new_fd);
+    close(new_fd);
+    free(zone);
+    free(sb);
+    return rename(tmp_filename, fsi_filename);
+}
+
+static void replay_region(void* ctx, uint64_t offset, char const* data, uint32_t length) {
+    FSImage* my_fsi = ctx;
+    // operations only log regions of zones, each record region lies in one
+    uint32_t z = offset < ZONES_OFFSET ? ZONES_MAX : (offset - ZONES_OFFSET) / sizeof(SMFS_zone);
+    if (z >= my_fsi->zone_count || offset + length > zone_offset(z + 1)) {
+        fprintf(stderr, "ERROR: (replay_region) log region [%llu, +%u) is outside the image\n", (unsigned long long)offset, length);
+        return;
+    }
+    memcpy(image_at(my_fsi, offset), data, length);
+    write_back(my_fsi, offset, length);
+}
+
+/*
+Open the redo log next to the image and bring the image up to date with it. Records that were committed
+but not yet checkpointed when the server stopped are replayed, then the log starts out empty.
+A freshly created image discards any log left behind by a previous image of the same name.
+Returns 1 if the server didn't stop cleanly (the log wasn't empty), 0 if it did, -1 on failure.
+*/
+static int open_log(FSImage* my_fsi, char const* fsi, bool created) {
+    char log_filename[strlen(fsi) + 6]; // ".mfsj" extension + '\0'
+    strcpy(log_filename, fsi);
+    strcat(log_filename, ".mfsj");
+    if (journal_open(&my_fsi->log, log_filename) < 0)
+        return -1;
+
+    bool unclean = !created && my_fsi->log.size > 0;
+    if (unclean) {
+        int replayed = journal_replay(&my_fsi->log, replay_region, my_fsi);
+        printf("SERVER:: replayed %d log records from '%s'\n", replayed, log_filename);
+        fsync(my_fsi->fd);
+    }
+    if (my_fsi->log.size > 0)
+        journal_reset(&my_fsi->log);
+    return unclean;
+}
+
+// bit blknum of the volume's block bitmaps, one per zone
+static void set_block_bit(bitarray* block_alloc, uint32_t blknum) {
+    set_bit(block_alloc[blknum / ZONE_BLOCKS], blknum % ZONE_BLOCKS);
+}
+
+static void set_visited_block(FSImage* my_fsi, uint32_t blknum, void* block_alloc) {
+    set_block_bit(block_alloc, blknum);
+}
+
+static bool test_block_bit(bitarray* block_alloc, uint32_t blknum) {
+    return test_bit(block_alloc[blknum / ZONE_BLOCKS], blknum % ZONE_BLOCKS);
+}
+
+/*
+Recompute the allocation bitmaps of every zone from the inode tables. Operations on different inodes are logged
+concurrently, so a logged bitmap word can carry bits of an operation whose own record never made it into the log;
+the inodes are what counts. Only needed after the server stopped with records in the log, or for an image an
+older version wrote. A preallocation window that overlaps blocks another file maps is dropped. Whatever changed
+is written back to the image. Returns the number of bitmap words and inodes fixed.
+*/
+static int rebuild_alloc_bitmaps(FSImage* my_fsi) {
+    uint32_t zones = my_fsi->zone_count;
+    uint32_t block_count = zones * ZONE_BLOCKS;
+    bitarray* inode_alloc = calloc(zones, sizeof(bitarray));
+    bitarray* block_alloc = calloc(zones, sizeof(bitarray));
+    dirty_set* fixed = calloc(zones, sizeof(dirty_set));
+    assert(inode_alloc != NULL && block_alloc != NULL && fixed != NULL);
+    int repaired = 0;
+
+    for (uint32_t inum = 0; inum < zones * ZONE_INODES; inum++) {
+        inode* in = get_inode(my_fsi, inum);
+        if (in->type == I_EMPTY)
+            continue;
+        set_bit(inode_alloc[inum / ZONE_INODES], inum % ZONE_INODES);
+        visit_mapped_blocks(my_fsi, in, set_visited_block, block_alloc);
+    }
+    for (uint32_t inum = 0; inum < zones * ZONE_INODES; inum++) {
+        inode* in = get_inode(my_fsi, inum);
+        bool overlaps = false;
+        for (uint32_t i = 0; i < in->prealloc_length; i++)
+            overlaps = overlaps || in->prealloc_start + i >= block_count || test_block_bit(block_alloc, in->prealloc_start + i);
+        if (overlaps) {
+            in->prealloc_start = 0;
+            in->prealloc_length = 0;
+            set_bit(fixed[inum / ZONE_INODES].inodes, inum % ZONE_INODES);
+            ++repaired;
+        }
+        for (uint32_t i = 0; i < in->prealloc_length; i++)
+            set_block_bit(block_alloc, in->prealloc_start + i);
+    }
+
+    for (uint32_t z = 0; z < zones; z++) {
+        SMFS_zone* disk = my_fsi->zones[z]->disk;
+        for (int i = 0; i < (int)ALLOC_WORDS; i++) {
+            if (disk->inode_alloc[i] != inode_alloc[z][i]) {
+                disk->inode_alloc[i] = inode_alloc[z][i];
+                set_bit(fixed[z].alloc_words, i);
+                ++repaired;
+            }
+            if (disk->block_alloc[i] != block_alloc[z][i]) {
+                disk->block_alloc[i] = block_alloc[z][i];
+                set_bit(fixed[z].alloc_words, ALLOC_WORDS + i);
+                ++repaired;
+            }
+        }
+        walk_dirty_set(my_fsi, z, &fixed[z], write_back);
+    }
+    if (repaired > 0)
+        fsync(my_fsi->fd);
+    free(fixed);
+    free(block_alloc);
+    free(inode_alloc);
+    return repaired;
+}
+
+/*
+Check the superblock of a version 5 or later image of file_size bytes. A file longer than its zones was being grown when
+the server stopped, the zone that didn't make it into the superblock is cut off.
+*/
+static int check_superblock(char const* fsi_filename, int fd, superblock const* sb, off_t file_size) {
+    if (sb->magic != SMFS_MAGIC || sb->version < 5 || sb->version > SMFS_VERSION) {
+        fprintf(stderr, "ERROR: (SMFS_open_file_system_image) '%s' has unsupported format (magic %#x, version %u)\n",
+            fsi_filename, sb->magic, sb->version);
+        return -1;
+    }
+    if (sb->zone_inodes != ZONE_INODES || sb->zone_blocks != ZONE_BLOCKS || sb->zone_count < 1 || sb->zone_count > ZONES_MAX ||
+        sb->inode_count != sb->zone_count * ZONE_INODES || sb->block_count != sb->zone_count * ZONE_BLOCKS) {
+        fprintf(stderr, "ERROR: (SMFS_open_file_system_image) '%s' has an invalid superblock (%u zones of %u inodes and %u blocks)\n",
+            fsi_filename, sb->zone_count, sb->zone_inodes, sb->zone_blocks);
+        return -1;
+    }
+    uint64_t expected = zone_offset(sb->zone_count);
+    if ((uint64_t)file_size < expected) {
+        fprintf(stderr, "ERROR: (SMFS_open_file_system_image) '%s' is %lld bytes, expected %llu\n",
+            fsi_filename, (long long)file_size, (unsigned long long)expected);
+        return -1;
+    }
+    if ((uint64_t)file_size > expected) {
+        printf("SERVER:: dropping a partly added zone from '%s'\n", fsi_filename);
+        int rc = ftruncate(fd, expected);
+        assert(rc == 0);
+        fsync(fd);
+    }
+    return 0;
+}
+
+/*
+Give back whatever a failed SMFS_open_file_system_image() loaded of the image (its zones and superblock) and
+close it. Returns NULL.
+*/
+static FSImage* discard_image(FSImage* my_fsi) {
+    for (uint32_t z = 0; z < ZONES_MAX; z++) {
+        if (my_fsi->zones[z] != NULL) {
+            unload_region(my_fsi, my_fsi->zones[z]->disk, sizeof(SMFS_zone));
+            free(my_fsi->zones[z]);
+        }
+    }
+    if (my_fsi->sb != NULL)
+        unload_region(my_fsi, my_fsi->sb, ZONES_OFFSET);
+    close(my_fsi->fd);
+    free(my_fsi);
+    return NULL;
+}
+
+/*
+Open file system image if it exists then return file descriptor.
+If file system image doesn't exist, will create a new file and call SMFS_init_file_system_image.
+*/
+FSImage* SMFS_open_file_system_image(char const* fsi, fsi_mode mode) {
+    FSImage* my_fsi = calloc(1, sizeof *my_fsi);
+    my_fsi->mode = mode;
+    my_fsi->zones_max = ZONES_MAX;
+    char fsi_filename[strlen(fsi) + 6]; // ".mfsi" extension + '\0'
+    strcpy(fsi_filename, fsi);
+    strcat(fsi_filename, ".mfsi");
+    int fd = open(fsi_filename, O_RDWR);
+    bool created = fd < 0 && errno == ENOENT;
+    bool upgraded = false; // written by an older version, whose bitmaps may be missing releases
+    if (created) {
+        // file does not exist, create it
+        printf("SERVER:: creating new file system image '%s'\n", fsi_filename);
+        fd = open(fsi_filename, O_RDWR | O_CREAT, S_IRWXU);
+        assert(fd > -1);
+        my_fsi->fd = fd;
+        int rc = ftruncate(fd, ZONES_OFFSET);
+        assert(rc == 0);
+        my_fsi->sb = load_region(my_fsi, 0, ZONES_OFFSET);
+        if (my_fsi->sb == NULL || SMFS_init_file_system_image(my_fsi) < 0)
+            return discard_image(my_fsi);
+    } else {
+        printf("SERVER:: opening existing file system image '%s'\n", fsi_filename);
+        assert(fd > -1);
+        struct stat statbuf;
+        fstat(fd, &statbuf);
+        superblock_v4 old_sb = {0};
+        if (statbuf.st_size == sizeof(SMFS_v1))
+            old_sb.version = 1;
+        else if (statbuf.st_size == sizeof(SMFS_v2) || statbuf.st_size == sizeof(SMFS_v3) || statbuf.st_size == sizeof(SMFS_v4))
+            read_at(fd, (char*)&old_sb, sizeof old_sb, 0);
+        if (old_sb.version == 1 || (old_sb.magic == SMFS_MAGIC && old_sb.version >= 2 && old_sb.version <= 4)) {
+            replay_old_log(fsi, fd);
+            int rc = convert_image(fsi_filename, fd, old_sb.version);
+            assert(rc == 0);
+            upgraded = true;
+            close(fd);
+            fd = open(fsi_filename, O_RDWR);
+            assert(fd > -1);
+            fstat(fd, &statbuf);
+        }
+        superblock sb = {0};
+        if (statbuf.st_size >= (off_t)sizeof sb)
+            read_at(fd, (char*)&sb, sizeof sb, 0);
+        if (check_superblock(fsi_filename, fd, &sb, statbuf.st_size) < 0) {
+            close(fd);
+            free(my_fsi);
+            return NULL;
+        }
+        my_fsi->fd = fd;
+        my_fsi->sb = load_region(my_fsi, 0, ZONES_OFFSET);
+        if (my_fsi->sb == NULL)
+            return discard_image(my_fsi);
+        if (my_fsi->sb->version < SMFS_VERSION) {
+            // versions 5 and 6 only lack what later ones can hold (hashed directories, deeper extent trees),
+            // so they are read as they are
+            printf("SERVER:: upgrading file system image '%s' from version %u to %d in place\n", fsi_filename, my_fsi->sb->version, SMFS_VERSION);
+            my_fsi->sb->version = SMFS_VERSION;
+            write_back(my_fsi, 0, sizeof *my_fsi->sb);
+            fsync(fd);
+            upgraded = true;
+        }
+        for (uint32_t z = 0; z < sb.zone_count; z++) {
+            my_fsi->zones[z] = load_zone(my_fsi, z);
+            if (my_fsi->zones[z] == NULL)
+                return discard_image(my_fsi);
+        }
+        my_fsi->zone_count = sb.zone_count;
+    }
+
+    int unclean = open_log(my_fsi, fsi, created);
+    if (unclean < 0)
+        return discard_image(my_fsi);
+    if (unclean || upgraded) {
+        int repaired = rebuild_alloc_bitmaps(my_fsi);
+        if (repaired > 0)
+            printf("SERVER:: repaired %d allocation bitmap words and preallocation windows\n", repaired);
+    }
+    my_fsi->free_inodes = 0;
+    my_fsi->free_blocks = 0;
+    for (uint32_t z = 0; z < my_fsi->zone_count; z++) {
+        zone* zn = my_fsi->zones[z];
+        init_hint(zn->disk->inode_alloc, ZONE_INODES, &zn->inode_hint);
+        init_hint(zn->disk->block_alloc, ZONE_BLOCKS, &zn->block_hint);
+        my_fsi->free_inodes += zn->inode_hint.free;
+        my_fsi->free_blocks += zn->block_hint.free;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    my_fsi->version_epoch = (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+
+    // prefer writers, a steady stream of lookups and reads would otherwise hold off mutations indefinitely
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&my_fsi->checkpoint_lock, &attr);
+    for (int i = 0; i < INODE_LOCK_STRIPES; i++)
+        pthread_rwlock_init(&my_fsi->inode_locks[i], &attr);
+    pthread_rwlock_init(&my_fsi->dirs_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&my_fsi->inode_alloc_lock, NULL);
+    pthread_mutex_init(&my_fsi->block_alloc_lock, NULL);
+    pthread_mutex_init(&my_fsi->log_lock, NULL);
+    pthread_mutex_init(&my_fsi->replies_lock, NULL);
+    pthread_cond_init(&my_fsi->log_synced_cv, NULL);
+    pthread_cond_init(&my_fsi->checkpoint_cv, NULL);
+
+    pthread_create(&my_fsi->checkpointer, NULL, checkpointer_main, my_fsi);
+    return my_fsi;
+}
+
+/*
+Stop serving the image: wait for the mutations in progress, write back everything logged and empty the log, so
+the next open has nothing to replay and no bitmaps to rebuild. Mutations block from then on, the process is
+expected to exit.
+*/
+void SMFS_close_file_system_image(FSImage* my_fsi) {
+    pthread_rwlock_wrlock(&my_fsi->checkpoint_lock);
+    write_back_logged(my_fsi);
+    fsync(my_fsi->fd);
+    pthread_mutex_lock(&my_fsi->log_lock);
+    journal_reset(&my_fsi->log);
+    pthread_mutex_unlock(&my_fsi->log_lock);
+}
+
+/*
+returns some information about the file specified by inum. Upon success, return 0, otherwise -1.
+The exact info returned is defined by MFS_Stat_t. A hashed directory reports the blocks MFS_Read() serves for it.
+Failure modes: inum does not exist.
+Called with inum locked.
+*/
+static int stat_file(FSImage* my_fsi, int inum, MFS_Stat_t* stat) {
+    if (
+        is_valid_file_type(my_fsi, inum, I_EMPTY) // inum is empty i.e. doesn't exist
+    ) {
+        fprintf(stderr, "ERROR: (SMFS_stat) invalid inum\n");
+        return -1;
+    }
+
+    inode* my_inode = get_inode(my_fsi, inum);
+    
+    my_inode->type == I_DIRECTORY ?
+        (stat->type = MFS_DIRECTORY) :
+        (stat->type = MFS_REGULAR_FILE);
+    stat->size = my_inode->size;
+    stat->blocks = my_inode->type == I_DIRECTORY ? dir_blocks(my_inode) : my_inode->block_alloc_count;
+    return 0;
+}
+
+int SMFS_stat(FSImage* my_fsi, int inum, MFS_Stat_t* stat) {
+    if (!is_valid_inum(my_fsi, inum)) {
+        fprintf(stderr, "ERROR: (SMFS_stat) invalid inum\n");
+        return -1;
+    }
+    pthread_rwlock_rdlock(inode_lock(my_fsi, inum));
+    int rc = stat_file(my_fsi, inum, stat);
+    pthread_rwlock_unlock(inode_lock(my_fsi, inum));
+    return rc;
+}
+
+/*
+takes the parent inode number (which should be the inode number of a directory) and looks up the entry name in it.
+The inode number of name is returned. 
+Success: return inode number of name;
+failure: return -1. Failure modes: invalid pinum, name does not exist in pinum.
+*/
+static int lookup_file(FSImage* my_fsi, int pinum, char const* name) {
+    if (!is_valid_file_type(my_fsi, pinum, I_DIRECTORY)) {
+        fprintf(stderr, "ERROR: (SMFS_lookup) parent inum '%d' is not a directory\n", pinum);
+        return -1;
+    }
+    int inum = dir_seek(my_fsi, pinum, name, NULL);
+    if (inum < 0) {
+        fprintf(stderr, "ERROR: (SMFS_lookup) filename '%s' is not in parent inum '%d'\n", name, pinum);
+        return -1;
+    }
+    return inum;
+}
+
+int SMFS_lookup(FSImage* my_fsi, int pinum, char* name) {
+    if (!is_valid_inum(my_fsi, pinum)) {
+        fprintf(stderr, "ERROR: (SMFS_lookup) invalid parent inum '%d'\n", pinum);
+        return -1;
+    }
+    pthread_rwlock_rdlock(inode_lock(my_fsi, pinum));
+    int inum = lookup_file(my_fsi, pinum, name);
+    pthread_rwlock_unlock(inode_lock(my_fsi, pinum));
+    return inum;
+}
+
+/*
+Resolve a '/' separated path one component at a time, starting in directory pinum. Empty components are
+skipped, so "a//b/" is "a/b" and an empty path resolves to pinum itself. If stat isn't NULL it is filled in
+for the final inode.
+Success: return inode number at the end of path;
+failure: return -1. Failure modes: invalid pinum, a component is missing, too long, or not a directory.
+*/
+int SMFS_lookup_path(FSImage* my_fsi, int pinum, char const* path, MFS_Stat_t* stat) {
+    if (!is_valid_inum(my_fsi, pinum)) {
+        fprintf(stderr, "ERROR: (SMFS_lookup_path) invalid parent inum '%d'\n", pinum);
+        return -1;
+    }
+
+    // one inode is locked at a time: the directory being searched, then whatever was found in it
+    int locked = pinum;
+    pthread_rwlock_rdlock(inode_lock(my_fsi, locked));
+    int inum = pinum;
+    if (is_valid_file_type(my_fsi, pinum, I_EMPTY)) {
+        fprintf(stderr, "ERROR: (SMFS_lookup_path) invalid parent inum '%d'\n", pinum);
+        inum = -1;
+    }
+
+    char const* component = path;
+    while (inum >= 0 && *component != '\0') {
+        size_t len = strcspn(component, "/");
+        if (len > 0) {
+            char name[DNAME_MAX];
+            if (!is_valid_file_type(my_fsi, inum, I_DIRECTORY)) {
+                fprintf(stderr, "ERROR: (SMFS_lookup_path) '%.*s' in '%s' is not a directory\n", (int)(component - path), path, path);
+                inum = -1;
+            } else if (len >= DNAME_MAX) {
+                fprintf(stderr, "ERROR: (SMFS_lookup_path) component of '%s' is longer than %d bytes\n", path, DNAME_MAX-1);
+                inum = -1;
+            } else {
+                memcpy(name, component, len);
+                name[len] = '\0';
+                inum = dir_seek(my_fsi, inum, name, NULL);
+                if (inum < 0)
+                    fprintf(stderr, "ERROR: (SMFS_lookup_path) '%s' of '%s' does not exist\n", name, path);
+            }
+            if (inum < 0)
+                break;
+            pthread_rwlock_unlock(inode_lock(my_fsi, locked));
+            locked = inum;
+            pthread_rwlock_rdlock(inode_lock(my_fsi, locked));
+        }
+        component += len;
+        if (*component == '/')
+            ++component;
+    }
+
+    // fails if the entry was unlinked after its directory was unlocked
+    if (inum >= 0 && stat && stat_file(my_fsi, inum, stat) < 0)
+        inum = -1;
+    pthread_rwlock_unlock(inode_lock(my_fsi, locked));
+    return inum;
+}
+
+/*
+Make sure count blocks are free, growing the volume or taking back preallocation windows if they aren't.
+Called with block_alloc_lock held.
+*/
+static bool have_free_blocks(FSImage* my_fsi, int64_t count) {
+    if (my_fsi->free_blocks < count && my_fsi->zone_count < my_fsi->zones_max)
+        grow_volume(my_fsi, my_fsi->zone_count);
+    if (my_fsi->free_blocks < count)
+        reclaim_preallocations(my_fsi);
+    return my_fsi->free_blocks >= count;
+}
+
+/*
+Rewrite legacy directory pinum, which is full, as a hashed directory with the same entries. They are laid out
+in scratch buckets first, as few as hold them, so the blocks needed are known and taken before the old ones are
+freed. Returns -1 if the volume is full. Called with pinum locked.
+*/
+static int convert_directory(FSImage* my_fsi, int pinum) {
+    inode* parent_inode = get_inode(my_fsi, pinum);
+    dir_file_entry* entries[BLOCK_PTRS * DENTRIES_MAX];
+    int count = 0;
+    for (uint32_t i = 0; i < parent_inode->block_alloc_count; i++) {
+        dir_file* dir = &get_block(my_fsi, inode_lookup_block(my_fsi, parent_inode, i))->b_directory;
+        for (int j = 0; j < dir->d_count; j++)
+            entries[count++] = &dir->d_entries[j];
+    }
+
+    dir_bucket* buckets = NULL;
+    uint32_t n = 0;
+    for (bool placed = false; !placed; ) {
+        if (++n > DIR_BUCKETS_MAX) {
+            free(buckets);
+            return -1;
+        }
+        buckets = realloc(buckets, n * sizeof *buckets);
+        assert(buckets != NULL);
+        for (uint32_t b = 0; b < n; b++)
+            bucket_init(&buckets[b]);
+        placed = true;
+        for (int i = 0; i < count && placed; i++) {
+            char const* name = entries[i]->d_name;
+            placed = bucket_insert(&buckets[dir_bucket_of(dir_name_hash(name), n)], name, entries[i]->inode_num) > -1;
+        }
+    }
+
+    // n buckets, and a leaf block in case their extents don't fit in the inode
+    pthread_mutex_lock(&my_fsi->block_alloc_lock);
+    if (!have_free_blocks(my_fsi, n + 1)) {
+        pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+        free(buckets);
+        return -1;
+    }
+    inode_free_blocks(my_fsi, pinum); // freed blocks keep their contents until the operation ends
+    parent_inode->flags |= INODE_DIR_HASHED;
+    for (uint32_t b = 0; b < n; b++) {
+        int blknum = inode_map_block(my_fsi, pinum, b);
+        assert(blknum > -1);
+        memcpy(get_block(my_fsi, blknum), &buckets[b], sizeof *buckets);
+        mark_block_dirty(my_fsi, blknum);
+    }
+    pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+    free(buckets);
+    mark_inode_dirty(my_fsi, pinum);
+
+    // the index still points into the old blocks
+    dir_index* idx = &my_fsi->dirs;
+    pthread_rwlock_wrlock(&my_fsi->dirs_lock);
+    if (dir_index_loaded(idx, pinum)) {
+        for (int i = 0; i < count; i++)
+            dir_index_remove(idx, dir_index_find(idx, pinum, entries[i]->d_name));
+        for (uint32_t b = 0; b < n; b++)
+            index_bucket(idx, pinum, &get_block(my_fsi, inode_lookup_block(my_fsi, parent_inode, b))->b_bucket, b);
+    }
+    pthread_rwlock_unlock(&my_fsi->dirs_lock);
+    printf("SERVER:: directory inode %d now has %u hashed blocks\n", pinum, n);
+    return 0;
+}
+
+// give back an inode create_file() reserved but didn't use, nothing else has been changed yet
+static void unreserve_inode(FSImage* my_fsi, int inum) {
+    zone* zn = my_fsi->zones[inum / ZONE_INODES];
+    pthread_mutex_lock(&my_fsi->inode_alloc_lock);
+    release_bit(zn->disk->inode_alloc, inum % ZONE_INODES, &zn->inode_hint);
+    __atomic_fetch_add(&my_fsi->free_inodes, 1, __ATOMIC_RELAXED);
+    clear_bit(op.zones[inum / ZONE_INODES]->dirty.alloc_words, inum % ZONE_INODES / ALLOC_WORD_BITS);
+    pthread_mutex_unlock(&my_fsi->inode_alloc_lock);
+}
+
+static int create_file(FSImage* my_fsi, int pinum, i_type type, char const* filename) {
+    if (my_fsi == NULL || type == I_EMPTY || !is_valid_inum(my_fsi, pinum) || strlen(filename) == 0 || strlen(filename) >= DNAME_MAX) {
+        fprintf(stderr, "ERROR: (SMFS_create_file) invalid input\n");
+        return -1;
+    }
+
+    // get new inode first, so it can be locked together with the parent in lock order
+    pthread_mutex_lock(&my_fsi->inode_alloc_lock);
+    int new_inode_index = empty_inode_index(my_fsi);
+    pthread_mutex_unlock(&my_fsi->inode_alloc_lock);
+    if (new_inode_index < 0) {
+        fprintf(stderr, "ERROR: (SMFS_create_file) file system is full\n");
+        return -1;
+    }
+    lock_inodes(my_fsi, pinum, new_inode_index);
+    
+    inode* parent_inode = get_inode(my_fsi, pinum);
+    if(parent_inode->type != I_DIRECTORY) {
+        fprintf(stderr, "ERROR: (SMFS_create_file) inode[pinum=%d] is not a directory\n", pinum);
+        unreserve_inode(my_fsi, new_inode_index);
+        return -1;
+    }
+
+    if(dir_seek(my_fsi, pinum, filename, NULL) >= 0) {
+        // "If name already exists, return success (think about why)."
+        printf("SERVER::SMFS_create_file file '%s' already exists\n", filename);
+        unreserve_inode(my_fsi, new_inode_index);
+        return 0;
+    }
+
+    // find space to put new directory entry, a legacy directory that is full becomes a hashed one
+    bool new_block_required = false;
+    int blkptr = -1;
+    if (!is_hashed_dir(parent_inode)) {
+        blkptr = inode_get_free_block(my_fsi, parent_inode, &new_block_required);
+        if (blkptr < 0 && convert_directory(my_fsi, pinum) < 0) {
+            fprintf(stderr, "ERROR: (SMFS_create_file) directory file is out of space\n");
+            unreserve_inode(my_fsi, new_inode_index);
+            return -1;
+        }
+    }
+
+    // check up front so none of the allocations below can fail half way through
+    pthread_mutex_lock(&my_fsi->block_alloc_lock);
+    int blocks_required = (new_block_required ? 1 : 0) + (type == I_DIRECTORY ? 1 : 0);
+    if (!have_free_blocks(my_fsi, blocks_required)) {
+        pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+        fprintf(stderr, "ERROR: (SMFS_create_file) file system is full\n");
+        unreserve_inode(my_fsi, new_inode_index);
+        return -1;
+    }
+
+    int dir_blknum = -1;
+    if (!is_hashed_dir(parent_inode)) {
+        dir_blknum = new_block_required ?
+            inode_map_block(my_fsi, pinum, blkptr) :
+            inode_lookup_block(my_fsi, parent_inode, blkptr);
+    }
+    if(type == I_DIRECTORY)
+        init_directory(my_fsi, new_inode_index, pinum);
+    pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+    
+    // create new directory entry + update parent inode
+    if (is_hashed_dir(parent_inode)) {
+        // the only step that can still fail: the directory may not be able to add a bucket
+        if (add_hashed_entry(my_fsi, pinum, new_inode_index, filename) < 0) {
+            inode_free_blocks(my_fsi, new_inode_index);
+            memset(get_inode(my_fsi, new_inode_index), 0, sizeof(inode));
+            mark_inode_dirty(my_fsi, new_inode_index);
+            free_inode(my_fsi, new_inode_index);
+            return -1;
+        }
+    } else {
+        dir_file* dir = &get_block(my_fsi, dir_blknum)->b_directory;
+        add_dir_entry(my_fsi, pinum, blkptr, dir, new_inode_index, filename);
+        mark_block_dirty(my_fsi, dir_blknum);
+    }
+    parent_inode->size += sizeof(dir_file_entry);
+    mark_inode_dirty(my_fsi, pinum);
+    
+    // init new inode, a new directory got its block above and is indexed on its first lookup
+    if (type == I_FILE) {
+        inode* new_inode = get_inode(my_fsi, new_inode_index);
+        new_inode->type = I_FILE;
+        new_inode->size = 0;
+        new_inode->block_alloc_count = 0;
+        mark_inode_dirty(my_fsi, new_inode_index);
     }
-    return -1; // 0 = invalid inode
-}
 
-static bool is_valid_file_name(FSImage* my_fsi, int pinum, char const* name) {
-    return dir_find_inode(my_fsi, pinum, name) == -1 ? false : true;
+    return 0;
 }
 
-static dir_file_entry* add_dir_entry(dir_file* dir, int inum, char const* filename) {
-    // is space in current dir file ?
-    if (dir->d_count < DENTRIES_MAX) {
-        dir_file_entry* new_entry = &dir->d_entries[dir->d_count];
-        new_entry->inode_num = inum;
-        strcpy(new_entry->d_name, filename);
-        ++(dir->d_count); // update directory count
-        return new_entry;
-    }
-    printf("dir count = %d\n",dir->d_count);
-    fprintf(stderr, "ERROR: add_dir_entry() failure. THIS SHOULD NEVER HAPPEN, SOMETHING IS WRONG\n");
-    return NULL;
-
+int SMFS_create_file(FSImage* my_fsi, int pinum, i_type type, char const* filename) {
+    begin_op(my_fsi);
+    int rc = create_file(my_fsi, pinum, type, filename);
+    end_op(my_fsi);
+    return rc;
 }
 
-static dir_file* find_dir_file(FSImage* my_fsi, int inum, char const* filename) {
-    dir_file* found = NULL;
-    inode* inode = &my_fsi->mfs->inode_table[inum];
+static bool is_past_end(inode const* inode, int blkoffset) {
+    return inode->type == I_DIRECTORY ?
+        (unsigned)blkoffset >= dir_blocks(inode) :
+        (uint64_t)blkoffset * BLOCK_SIZE >= inode->size;
+}
 
-    for(int i=0; i<BLOCK_PTRS; i++) {
-        dir_file* found = &inode->block_ptrs[i]->b_directory;
-        if (found != NULL) {
-            for(int j=0; j<found->d_count; j++) {
-                dir_file_entry* entry = &found->d_entries[j];
-                if (strcmp(entry->d_name, filename) == 0) {
-                    return found;
-                }
+/*
+Block blkoffset of hashed directory in the way MFS_Read() has always returned directory blocks: its entries
+[blkoffset * DENTRIES_MAX, (blkoffset + 1) * DENTRIES_MAX) in bucket order, as dir_file_entries written to view
+(no alignment needed). Returns the number of bytes filled in.
+*/
+static int hashed_dir_view(FSImage* my_fsi, inode* in, int blkoffset, char* view) {
+    uint32_t skip = (uint32_t)blkoffset * DENTRIES_MAX;
+    int filled = 0;
+    for (uint32_t lblk = 0; lblk < in->block_alloc_count && filled < DENTRIES_MAX; lblk++) {
+        dir_bucket* b = &get_block(my_fsi, inode_lookup_block(my_fsi, in, lblk))->b_bucket;
+        if (skip >= b->count) {
+            skip -= b->count;
+            continue;
+        }
+        for (size_t off = 0; off < sizeof b->records && filled < DENTRIES_MAX; off += record_at(b, off)->rec_len) {
+            dir_record* r = record_at(b, off);
+            if (r->name_len == 0)
+                continue;
+            if (skip > 0) {
+                --skip;
+                continue;
             }
+            dir_file_entry entry = { .inode_num = r->inode_num };
+            memcpy(entry.d_name, r->name, r->name_len);
+            entry.d_name[r->name_len] = '\0';
+            memcpy(view + filled++ * sizeof entry, &entry, sizeof entry);
         }
     }
-    return found;
+    return filled * sizeof(dir_file_entry);
 }
 
-static int remove_dir_entry(dir_file* dir, char const*filename) {
-    // find entry
-    dir_file_entry* found = NULL;
-    int index = 0;
-    for (index=0; index<dir->d_count; index++) {
-        if(strcmp(dir->d_entries[index].d_name, filename) == 0) {
-            found = &dir->d_entries[index];
-            break;
-        }
-        ++found;
+/*
+Point *data at block blkoffset of inum without copying it. Returns the number of bytes there (a directory
+block only holds its entries), -1 on failure. *data stays valid until the next mutating operation. A hashed
+directory has no such block, its entries are rendered into view (BLOCK_SIZE bytes) and *data points there.
+Called with inum locked.
+*/
+static int read_block_ref(FSImage* my_fsi, int inum, int blkoffset, char const** data, char* view) {
+    static char const zero_block[BLOCK_SIZE];
+
+    if (
+        !is_valid_blkoffset(blkoffset) ||
+        is_valid_file_type(my_fsi, inum, I_EMPTY) // cannot read empty block
+    ) {
+        fprintf(stderr, "ERROR: (SMFS_read_block) invalid input\n");
+        return -1;
     }
-    if(found == NULL)
+
+    inode* inode = get_inode(my_fsi, inum);
+    if (is_past_end(inode, blkoffset)) {
+        fprintf(stderr, "ERROR: (SMFS_read_block) blkoffset is past the end of inum '%d'\n", inum);
         return -1;
+    }
 
-    int deleted_entry_inum = found->inode_num;
-    
-    // if file is last entry in dir file
-    if (index == (dir->d_count)-1) {
-        memset(found, 0, sizeof *found); // reset file entry
-        --(dir->d_count);
-        return deleted_entry_inum;
+    if (is_hashed_dir(inode)) {
+        *data = view;
+        return hashed_dir_view(my_fsi, inode, blkoffset, view);
     }
 
-    // copy last element into the deleted dir entry's location
-    memcpy(found, &dir->d_entries[dir->d_count -1] , sizeof *found);
-    memset(&dir->d_entries[dir->d_count -1], 0, sizeof *found);
-    --(dir->d_count);
-    return deleted_entry_inum;
-}
+    int blknum = inode_lookup_block(my_fsi, inode, blkoffset);
+    if (blknum < 0) {
+        // hole in a regular file, never written
+        *data = zero_block;
+        return BLOCK_SIZE;
+    }
 
-static void update_inode(inode* in, unsigned size, unsigned blocks_allocated) {
-    (in->size) += size;
+    block* src = get_block(my_fsi, blknum);
+    *data = (char const*)src;
+    return inode->type == I_DIRECTORY ? get_dir_size(&src->b_directory) : BLOCK_SIZE;
+}
 
-    (in->block_alloc_count) += blocks_allocated;
-    // Note: if block allocated, this function doesn't deal with updating inode->block_ptrs with that new block
+/*
+Copy block blkoffset of inum into buffer. Returns the number of bytes copied (a directory block only holds
+its entries), -1 on failure.
+*/
+int SMFS_read_block(FSImage* my_fsi, int inum, char* buffer, int blkoffset) {
+    if (!is_valid_inum(my_fsi, inum)) {
+        fprintf(stderr, "ERROR: (SMFS_read_block) invalid input\n");
+        return -1;
+    }
+    char const* data;
+    pthread_rwlock_rdlock(inode_lock(my_fsi, inum));
+    int bytes_read = read_block_ref(my_fsi, inum, blkoffset, &data, buffer);
+    if (bytes_read > 0 && data != buffer)
+        memcpy(buffer, data, bytes_read);
+    pthread_rwlock_unlock(inode_lock(my_fsi, inum));
+    return bytes_read;
 }
 
-static int remove_block_from_bitarray(FSImage* my_fsi, block* block_ptr) {
-    for(int i=0; i<BLOCK_COUNT; i++) {
-        if (block_ptr == &my_fsi->mfs->data_blocks[i]) {
-            clear_bit(my_fsi->mfs->block_alloc, i);
-            return 0;
-        }
+/*
+Copy count blocks of inum from blkoffset on into buffer, one BLOCK_SIZE slot each (a directory block's slot is
+zeroed past its entries). The range may run past the end of the file, only its first block has to be there.
+Returns the number of blocks copied, -1 on failure.
+*/
+int SMFS_read_blocks(FSImage* my_fsi, int inum, char* buffer, int blkoffset, int count) {
+    if (!is_valid_inum(my_fsi, inum) || count < 1) {
+        fprintf(stderr, "ERROR: (SMFS_read_blocks) invalid input\n");
+        return -1;
     }
-    return -1;
+    pthread_rwlock_rdlock(inode_lock(my_fsi, inum));
+    int copied = 0;
+    for (; copied < count; copied++) {
+        if (copied > 0 && is_past_end(get_inode(my_fsi, inum), blkoffset + copied))
+            break;
+        char const* data;
+        char* slot = buffer + copied * BLOCK_SIZE;
+        int bytes_read = read_block_ref(my_fsi, inum, blkoffset + copied, &data, slot);
+        if (bytes_read < 0)
+            break;
+        if (data != slot)
+            memcpy(slot, data, bytes_read);
+        memset(slot + bytes_read, 0, BLOCK_SIZE - bytes_read);
+    }
+    pthread_rwlock_unlock(inode_lock(my_fsi, inum));
+    return copied > 0 ? copied : -1;
 }
 
 /*
-Initialize file system image to include an empty root directory with . and .. entries.
-Create space big enough for inode table and 4096 data blocks.
+Directory listings (MFS_ReadDir) go in the order of each entry's key, the bit-reversed hash of its name. A bucket
+of a hashed directory then holds one contiguous range of keys and a split divides its range in two, so a cursor
+(the key to go on from) stays valid across any change to the directory and across server restarts: every entry
+that is there for the whole listing is returned exactly once. Entries with equal keys go in the same reply.
 */
-int SMFS_init_file_system_image(FSImage* my_fsi) {
-    // create file system image
-    SMFS* my_file_system = calloc(1, sizeof *my_file_system);
-    my_fsi->mfs = my_file_system;
 
-    // init root directory
-    int root_inum = 0;
-    init_directory(my_fsi, root_inum, root_inum); // inum + parent inum are the same for root dir
-    set_bit(my_file_system->inode_alloc, root_inum); // update allocated inode bitarray
+typedef struct dir_listing_ {
+    uint32_t    key;
+    int         inum;
+    char const* name;
+} dir_listing;
+
+static uint32_t reverse_bits(uint32_t x) {
+    x = (x >> 1 & 0x55555555u) | (x & 0x55555555u) << 1;
+    x = (x >> 2 & 0x33333333u) | (x & 0x33333333u) << 2;
+    x = (x >> 4 & 0x0f0f0f0fu) | (x & 0x0f0f0f0fu) << 4;
+    x = (x >> 8 & 0x00ff00ffu) | (x & 0x00ff00ffu) << 8;
+    return x >> 16 | x << 16;
+}
 
-    // write file system image to disk
-    force_to_disk(my_fsi);
-    return 0;
+static uint32_t dir_key(char const* name) {
+    return reverse_bits(dir_name_hash(name));
+}
+
+static int compare_listing(void const* a, void const* b) {
+    uint32_t ka = ((dir_listing const*)a)->key, kb = ((dir_listing const*)b)->key;
+    return ka < kb ? -1 : ka > kb;
 }
 
 /*
-Open file system image if it exists then return file descriptor.
-If file system image doesn't exist, will create a new file and call SMFS_init_file_system_image.
+Entries of directory in with keys in [key, *end), sorted. *end is the end of the key range of the bucket holding
+key (MFS_READDIR_END for a legacy directory, which is listed all at once). Returns the number of entries.
 */
-FSImage* SMFS_open_file_system_image(char const* fsi) {
-    FSImage* my_fsi = malloc(sizeof *my_fsi);
-    char fsi_filename[strlen(fsi) + 6]; // ".mfsi" extension + '\0'
-    strcpy(fsi_filename, fsi);
-    strcat(fsi_filename, ".mfsi");
-    int fd = open(fsi_filename, O_RDWR);
-    if (fd < 0 && errno == ENOENT) {
-        // file does not exist, create it
-        printf("SERVER:: creating new file system image '%s'\n", fsi_filename);
-        fd = open(fsi_filename, O_RDWR | O_CREAT, S_IRWXU);
-        assert(fd > -1);
-        my_fsi->fd = fd;
-        SMFS_init_file_system_image(my_fsi);
+static int list_dir_range(FSImage* my_fsi, inode* in, uint64_t key, uint64_t* end, dir_listing* list) {
+    int count = 0;
+    if (is_hashed_dir(in)) {
+        uint32_t n = in->block_alloc_count;
+        uint32_t level = bucket_level(n);
+        uint32_t hash = reverse_bits(key);
+        uint32_t lblk = dir_bucket_of(hash, n);
+        int depth = __builtin_ctz(level) + (lblk < n - level || lblk >= level ? 1 : 0);
+        *end = ((key >> (32 - depth)) + 1) << (32 - depth);
+        dir_bucket* b = &get_block(my_fsi, inode_lookup_block(my_fsi, in, lblk))->b_bucket;
+        for (size_t off = 0; off < sizeof b->records; off += record_at(b, off)->rec_len) {
+            dir_record* r = record_at(b, off);
+            if (r->name_len > 0 && dir_key(r->name) >= key)
+                list[count++] = (dir_listing){ .key = dir_key(r->name), .inum = r->inode_num, .name = r->name };
+        }
     } else {
-        printf("SERVER:: opening existing file system image '%s'\n", fsi_filename);
-        // get size of file + malloc buffer of that size
-        struct stat statbuf;
-        fstat(fd, &statbuf);
-        char* readbuf = malloc(statbuf.st_size);
-        
-        // read file contents into buffer
-        char* read_ptr = readbuf;
-        ssize_t left_to_read = statbuf.st_size;
-        while (left_to_read > 0) {
-            ssize_t bytes_read = read(fd, read_ptr, left_to_read);
-            read_ptr += bytes_read;
-            left_to_read -= bytes_read;
-        }
-        assert(left_to_read == 0);
-
-        // init my_fsi
-        my_fsi->fd = fd;
-        my_fsi->mfs = (SMFS*)readbuf;
+        *end = MFS_READDIR_END;
+        for (uint32_t i = 0; i < in->block_alloc_count; i++) {
+            dir_file* dir = &get_block(my_fsi, inode_lookup_block(my_fsi, in, i))->b_directory;
+            for (int j = 0; j < dir->d_count; j++) {
+                dir_file_entry* entry = &dir->d_entries[j];
+                if (dir_key(entry->d_name) >= key)
+                    list[count++] = (dir_listing){ .key = dir_key(entry->d_name), .inum = entry->inode_num, .name = entry->d_name };
+            }
+        }
     }
-    return my_fsi;
+    qsort(list, count, sizeof *list, compare_listing);
+    return count;
 }
 
-// what about closing the file system image?
+static int listing_record_size(dir_listing const* entry) {
+    return (offsetof(MFS_DirRecord_t, name) + strlen(entry->name) + 1 + 3) & ~3;
+}
 
 /*
-takes the parent inode number (which should be the inode number of a directory) and looks up the entry name in it.
-The inode number of name is returned. 
-Success: return inode number of name;
-failure: return -1. Failure modes: invalid pinum, name does not exist in pinum.
+Pack the entries of directory inum from *cursor on into buffer as MFS_DirRecord_ts, as many as fit in nbytes,
+and advance *cursor past them (MFS_READDIR_END once the whole directory is listed). With MFS_READDIR_PLUS every
+record also carries its inode's type and size. Returns the number of bytes used, -1 on failure.
 */
-int SMFS_lookup(FSImage* my_fsi, int pinum, char* name) {
-    if (!is_valid_inum(pinum)) {
-        fprintf(stderr, "ERROR: (SMFS_lookup) invalid parent inum '%d'\n", pinum);
+int SMFS_read_dir(FSImage* my_fsi, int inum, uint64_t* cursor, int flags, char* buffer, int nbytes) {
+    if (!is_valid_inum(my_fsi, inum) || *cursor > MFS_READDIR_END || nbytes < 0) {
+        fprintf(stderr, "ERROR: (SMFS_read_dir) invalid input\n");
         return -1;
-    } else if (!is_valid_file_type(my_fsi, pinum, I_DIRECTORY)) {
-        fprintf(stderr, "ERROR: (SMFS_lookup) parent inum '%d' is not a directory\n", pinum);
+    }
+    pthread_rwlock_rdlock(inode_lock(my_fsi, inum));
+    inode* in = get_inode(my_fsi, inum);
+    if (in->type != I_DIRECTORY) {
+        pthread_rwlock_unlock(inode_lock(my_fsi, inum));
+        fprintf(stderr, "ERROR: (SMFS_read_dir) inum %d is not a directory\n", inum);
         return -1;
-    } else if (!is_valid_file_name(my_fsi, pinum, name)) {
-        fprintf(stderr, "ERROR: (SMFS_lookup) filename '%s' is not in parent inum '%d'\n", name, pinum);
+    }
+
+    dir_listing list[BLOCK_SIZE / 8]; // more than a bucket or a legacy directory holds
+    int used = 0;
+    uint64_t key = *cursor;
+    bool full = false;
+    while (key < MFS_READDIR_END && !full) {
+        uint64_t end;
+        int count = list_dir_range(my_fsi, in, key, &end, list);
+        for (int i = 0; i < count && !full; ) {
+            // the entries sharing a key can't be told apart by a cursor, they go together or not at all
+            int bytes = 0, j = i;
+            for (; j < count && list[j].key == list[i].key; j++)
+                bytes += listing_record_size(&list[j]);
+            if (used + bytes > nbytes) {
+                key = list[i].key;
+                full = true;
+                break;
+            }
+            for (; i < j; i++) {
+                MFS_DirRecord_t* rec = (MFS_DirRecord_t*)(buffer + used);
+                size_t len = strlen(list[i].name);
+                rec->inum = list[i].inum;
+                rec->reclen = listing_record_size(&list[i]);
+                rec->namelen = len;
+                rec->type = MFS_READDIR_NOTYPE;
+                rec->size = -1;
+                memcpy(rec->name, list[i].name, len + 1);
+                used += rec->reclen;
+            }
+        }
+        if (!full)
+            key = end;
+    }
+    pthread_rwlock_unlock(inode_lock(my_fsi, inum));
+    if (full && used == 0) {
+        fprintf(stderr, "ERROR: (SMFS_read_dir) %d bytes don't hold the next entry of inum %d\n", nbytes, inum);
         return -1;
     }
-    return dir_find_inode(my_fsi, pinum, name);
+    *cursor = key;
+
+    // one inode at a time, not while holding the directory: an entry unlinked in between keeps NOTYPE
+    if (flags & MFS_READDIR_PLUS) {
+        for (int off = 0; off < used; off += ((MFS_DirRecord_t*)(buffer + off))->reclen) {
+            MFS_DirRecord_t* rec = (MFS_DirRecord_t*)(buffer + off);
+            MFS_Stat_t stat;
+            if (SMFS_stat(my_fsi, rec->inum, &stat) == 0) {
+                rec->type = stat.type;
+                rec->size = stat.size;
+            }
+        }
+    }
+    return used;
 }
 
-int SMFS_create_file(FSImage* my_fsi, int pinum, i_type type, char const* filename) {
-    if (type == I_EMPTY || pinum < 0 || my_fsi == NULL || strlen(filename) == 0) {
-        fprintf(stderr, "ERROR: (SMFS_create_file) invalid input\n");
+/*
+Write count blocks from buffer to inum starting at blkoffset, as one operation. If a block can't be written the
+ones before it stay written.
+*/
+static int write_blocks(FSImage* my_fsi, int inum, char const* buffer, int blkoffset, int count) {
+    if (!is_valid_inum(my_fsi, inum) || count < 1 || !is_valid_blkoffset(blkoffset) || !is_valid_blkoffset(blkoffset + count - 1)) {
+        fprintf(stderr, "ERROR: (SMFS_write_block) invalid input\n");
         return -1;
     }
-    
-    inode* parent_inode = &my_fsi->mfs->inode_table[pinum];
-    if(parent_inode->type != I_DIRECTORY) {
-        fprintf(stderr, "ERROR: (SMFS_create_file) inode[pinum=%d] is not a directory\n", pinum);
+    lock_inodes(my_fsi, inum, -1);
+    if (!is_valid_file_type(my_fsi, inum, I_FILE)) { // cannot write to directory
+        fprintf(stderr, "ERROR: (SMFS_write_block) invalid input\n");
         return -1;
     }
 
-    if(is_valid_file_name(my_fsi, pinum, filename)) {
-        // "If name already exists, return success (think about why)."
-        printf("SERVER::SMFS_create_file file '%s' already exists\n", filename);
-        return 0;
-    }
+    inode* my_inode = get_inode(my_fsi, inum);
+    for (int i = 0; i < count; i++) {
+        // blkoffset is the block within the file, allocate it on first write
+        int blknum = inode_lookup_block(my_fsi, my_inode, blkoffset + i);
+        if (blknum < 0) {
+            pthread_mutex_lock(&my_fsi->block_alloc_lock);
+            blknum = inode_map_block(my_fsi, inum, blkoffset + i);
+            pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+        }
+        if (blknum < 0) {
+            fprintf(stderr, "ERROR: (SMFS_write_block) file system is full\n");
+            return -1;
+        }
 
-    // get new inode
-    int new_inode_index = empty_inode_index(my_fsi);
+        // write block
+        block* dest = get_block(my_fsi, blknum);
+        memcpy(dest, buffer + i * BLOCK_SIZE, BLOCK_SIZE);
+        mark_block_dirty(my_fsi, blknum);
 
-    // find space to put new directory entry
-    bool new_block_required = false;
-    int blkptr = inode_get_free_block(my_fsi, parent_inode, &new_block_required);
-    if (blkptr < 0) {
-        fprintf(stderr, "ERROR: (SMFS_create_file) directory file is out of space\n");
-        return -1;
+        // update inode
+        uint64_t end = (uint64_t)(blkoffset + i + 1) * BLOCK_SIZE;
+        if (my_inode->size < end)
+            my_inode->size = end;
+        mark_inode_dirty(my_fsi, inum);
     }
+    return 0;
+}
 
-    if (new_block_required) {
-        int new_blk_index = empty_block_index(my_fsi);
-        parent_inode->block_ptrs[blkptr] = &my_fsi->mfs->data_blocks[new_blk_index];
-    }
-    dir_file* dir = &parent_inode->block_ptrs[blkptr]->b_directory;
-    
-    // create new directory entry + update parent inode
-    dir_file_entry* new_entry = add_dir_entry(dir, new_inode_index, filename);
-    update_inode(parent_inode, sizeof *new_entry, new_block_required ? 1 : 0);
-    
-    // create new file if necessary + init new inode
-    if(type == I_DIRECTORY) {
-        init_directory(my_fsi, new_inode_index, pinum);
-    } else if (type == I_FILE) {
-        inode* new_inode = &my_fsi->mfs->inode_table[new_inode_index];
-        new_inode->type = I_FILE;
-        new_inode->size = 0;
-        new_inode->block_alloc_count = 0;
-    }
+int SMFS_write_block(FSImage* my_fsi, int inum, char* buffer, int blkoffset) {
+    return SMFS_write_blocks(my_fsi, inum, buffer, blkoffset, 1);
+}
 
-    // write updates to disk
-    force_to_disk(my_fsi);
-    return 0;
+/*
+Write count consecutive blocks in one operation, so they share one log record and one fsync.
+*/
+int SMFS_write_blocks(FSImage* my_fsi, int inum, char const* buffer, int blkoffset, int count) {
+    begin_op(my_fsi);
+    int rc = write_blocks(my_fsi, inum, buffer, blkoffset, count);
+    end_op(my_fsi);
+    return rc;
 }
 
-int SMFS_read_block(FSImage* my_fsi, int inum, char* buffer, int blkoffset) {
-    if (
-        !is_valid_inum(inum) ||
-        !is_valid_blkoffset(blkoffset) ||
-        is_valid_file_type(my_fsi, inum, I_EMPTY) // cannot read empty block
-    ) {
-        fprintf(stderr, "ERROR: (SMFS_read_block) invalid input\n");
+/*
+Write nbytes from buffer to regular file inum at byte offset, as one operation. Only the blocks the bytes land in
+are allocated, and one allocated for part of its bytes is zeroed around them. The size grows to offset + nbytes.
+*/
+static int write_bytes(FSImage* my_fsi, int inum, char const* buffer, int offset, int nbytes) {
+    if (!is_valid_inum(my_fsi, inum) || offset < 0 || nbytes < 0 || (uint64_t)offset + nbytes > (uint64_t)FILE_BLOCKS_MAX * BLOCK_SIZE) {
+        fprintf(stderr, "ERROR: (SMFS_write_at) invalid input\n");
         return -1;
     }
-
-    inode* inode = &my_fsi->mfs->inode_table[inum];
-    if (blkoffset >= inode->block_alloc_count) {
-        fprintf(stderr, "ERROR: (SMFS_read_block) blkoffset >= inode->block_alloc_count\n");
+    lock_inodes(my_fsi, inum, -1);
+    if (!is_valid_file_type(my_fsi, inum, I_FILE)) { // cannot write to directory
+        fprintf(stderr, "ERROR: (SMFS_write_at) invalid input\n");
         return -1;
     }
 
-    // copy block to buffer
-    block* src = inode->block_ptrs[blkoffset];
-    inode->type == I_DIRECTORY ?
-        (memcpy(buffer, src, get_dir_size(&src->b_directory))) :
-        (memcpy(buffer, src, BLOCK_SIZE));
+    inode* my_inode = get_inode(my_fsi, inum);
+    for (int done = 0; done < nbytes;) {
+        int lblk = (offset + done) / BLOCK_SIZE;
+        int within = (offset + done) % BLOCK_SIZE;
+        int len = BLOCK_SIZE - within < nbytes - done ? BLOCK_SIZE - within : nbytes - done;
+        int blknum = inode_lookup_block(my_fsi, my_inode, lblk);
+        bool fresh = blknum < 0;
+        if (fresh) {
+            pthread_mutex_lock(&my_fsi->block_alloc_lock);
+            blknum = inode_map_block(my_fsi, inum, lblk);
+            pthread_mutex_unlock(&my_fsi->block_alloc_lock);
+        }
+        if (blknum < 0) {
+            fprintf(stderr, "ERROR: (SMFS_write_at) file system is full\n");
+            return -1;
+        }
 
+        // a freed block keeps its old contents, the part of a new one that isn't written must read as a hole
+        block* dest = get_block(my_fsi, blknum);
+        if (fresh && len < BLOCK_SIZE)
+            memset(dest, 0, sizeof dest->b_file);
+        memcpy(dest->b_file.f_data + within, buffer + done, len);
+        mark_block_dirty(my_fsi, blknum);
+        done += len;
+
+        if (my_inode->size < (uint64_t)offset + done)
+            my_inode->size = (uint64_t)offset + done;
+        mark_inode_dirty(my_fsi, inum);
+    }
     return 0;
 }
 
-int SMFS_write_block(FSImage* my_fsi, int inum, char* buffer, int blkoffset) {
-    if (
-        !is_valid_inum(inum) ||
-        !is_valid_blknum(blkoffset) ||
-        !is_valid_file_type(my_fsi, inum, I_FILE) // cannot write to directory
-    ) {
-        fprintf(stderr, "ERROR: (SMFS_write_block) invalid input\n");
-        return -1;
-    }
-
-    // write block
-    block* dest = &my_fsi->mfs->data_blocks[blkoffset];
-    memcpy(dest, buffer, BLOCK_SIZE);
-
-    // update inode
-    inode* my_inode = &my_fsi->mfs->inode_table[inum];
-    update_inode(my_inode, BLOCK_SIZE, 1);
-    my_inode->block_ptrs[(my_inode->block_alloc_count)-1] = dest; // unlink implementation reorders block ptrs if necessary, otherwise this won't work
-    
-    // write updates to disk
-    force_to_disk(my_fsi);
-    return 0;
+int SMFS_write_at(FSImage* my_fsi, int inum, char const* buffer, int offset, int nbytes) {
+    begin_op(my_fsi);
+    int rc = write_bytes(my_fsi, inum, buffer, offset, nbytes);
+    end_op(my_fsi);
+    return rc;
 }
 
 /*
-returns some information about the file specified by inum. Upon success, return 0, otherwise -1.
-The exact info returned is defined by MFS_Stat_t. 
-Failure modes: inum does not exist.
+Copy up to nbytes of regular file inum from byte offset on into buffer, holes read as zeros. Returns the number
+of bytes copied, fewer than nbytes if the file ends first (0 from its end on), -1 on failure.
 */
-int SMFS_stat(FSImage* my_fsi, int inum, MFS_Stat_t* stat) {
-    if (
-        !is_valid_inum(inum) ||
-        is_valid_file_type(my_fsi, inum, I_EMPTY) // inum is empty i.e. doesn't exist
-    ) {
-        fprintf(stderr, "ERROR: (SMFS_stat) invalid inum\n");
+int SMFS_read_at(FSImage* my_fsi, int inum, char* buffer, int offset, int nbytes) {
+    if (!is_valid_inum(my_fsi, inum) || offset < 0 || nbytes < 0) {
+        fprintf(stderr, "ERROR: (SMFS_read_at) invalid input\n");
+        return -1;
+    }
+    pthread_rwlock_rdlock(inode_lock(my_fsi, inum));
+    if (!is_valid_file_type(my_fsi, inum, I_FILE)) { // directories are listed with SMFS_read_dir()
+        pthread_rwlock_unlock(inode_lock(my_fsi, inum));
+        fprintf(stderr, "ERROR: (SMFS_read_at) invalid input\n");
         return -1;
     }
 
-    inode* my_inode = &my_fsi->mfs->inode_table[inum];
-    
-    my_inode->type == I_DIRECTORY ?
-        (stat->type = MFS_DIRECTORY) :
-        (stat->type = MFS_REGULAR_FILE);
-    stat->size = my_inode->size;
-    stat->blocks = my_inode->block_alloc_count;
-    return 0;
+    inode* in = get_inode(my_fsi, inum);
+    uint64_t end = (uint64_t)offset + nbytes < in->size ? (uint64_t)offset + nbytes : in->size;
+    int copied = 0;
+    for (uint64_t pos = offset; pos < end;) {
+        int within = pos % BLOCK_SIZE;
+        int len = BLOCK_SIZE - within < end - pos ? BLOCK_SIZE - within : (int)(end - pos);
+        int blknum = inode_lookup_block(my_fsi, in, pos / BLOCK_SIZE);
+        if (blknum < 0)
+            memset(buffer + copied, 0, len);
+        else
+            memcpy(buffer + copied, get_block(my_fsi, blknum)->b_file.f_data + within, len);
+        copied += len;
+        pos += len;
+    }
+    pthread_rwlock_unlock(inode_lock(my_fsi, inum));
+    return copied;
 }
 
 /*
@@ -473,22 +2851,34 @@ Failure modes:
     -the to-be-unlinked directory is NOT empty.
 Note that the name not existing is NOT a failure by our definition (think about why this might be).
 */
-int SMFS_unlink(FSImage* my_fsi, int pinum, char* filename) {
-    if (!is_valid_inum(pinum) || is_valid_file_type(my_fsi, pinum, I_EMPTY)) {
+static int unlink_file(FSImage* my_fsi, int pinum, char* filename) {
+    if (!is_valid_inum(my_fsi, pinum)) {
         fprintf(stderr, "ERROR: (SMFS_unlink) pinum[%d] does not exist\n", pinum);
         return -1;
-    } else if(!is_valid_file_type(my_fsi, pinum, I_DIRECTORY)) {
-        fprintf(stderr, "ERROR: (SMFS_unlink) pinum[%d] is not a directory\n", pinum);
-        return -1;
     }
 
-    if (!is_valid_file_name(my_fsi, pinum, filename)) {
+    // the child is only known once the parent is locked, and it may come first in lock order:
+    // lock the parent, find the child, then take both in order until the entry still names a locked child
+    dir_cursor cursor;
+    int inum = -1;
+    do {
+        unlock_inodes(my_fsi);
+        lock_inodes(my_fsi, pinum, inum);
+        if (is_valid_file_type(my_fsi, pinum, I_EMPTY)) {
+            fprintf(stderr, "ERROR: (SMFS_unlink) pinum[%d] does not exist\n", pinum);
+            return -1;
+        } else if(!is_valid_file_type(my_fsi, pinum, I_DIRECTORY)) {
+            fprintf(stderr, "ERROR: (SMFS_unlink) pinum[%d] is not a directory\n", pinum);
+            return -1;
+        }
+        inum = dir_seek(my_fsi, pinum, filename, &cursor);
+    } while (inum >= 0 && !holds_inode(inum));
+    if (inum < 0) {
         // Note that the name not existing is NOT a failure by our definition (think about why this might be).
         printf("SERVER::SMFS_unlink file '%s' does not exist in directory with pinum[%d]\n", filename, pinum);
         return 0;
     }
 
-    int inum = dir_find_inode(my_fsi, pinum, filename);
     if(is_valid_file_type(my_fsi, inum, I_DIRECTORY) && !is_dir_empty(my_fsi, inum)) {
         fprintf(stderr, "ERROR: (SMFS_unlink) to-be-unlinked directory file '%s' is NOT empty\n", filename);
         return -1;
@@ -496,94 +2886,286 @@ int SMFS_unlink(FSImage* my_fsi, int pinum, char* filename) {
 
     printf("SERVER::SMFS_unlink unlinking file '%s' from pinum[%d]\n", filename, pinum);
 
-    dir_file* dir = find_dir_file(my_fsi, pinum, filename);
+    inode* parent_inode = get_inode(my_fsi, pinum);
+    dir_file* dir = cursor.dir;
     
     // delete dir_entry from file & reorder dir file if necessary
-    int remove_inum = remove_dir_entry(dir, filename);
+    int remove_inum = is_hashed_dir(parent_inode) ?
+        remove_hashed_entry(my_fsi, pinum, &cursor) :
+        remove_dir_entry(my_fsi, pinum, &cursor);
 
-    inode* remove_inode = &my_fsi->mfs->inode_table[remove_inum];
+    inode* remove_inode = get_inode(my_fsi, remove_inum);
+    if (remove_inode->type == I_DIRECTORY)
+        drop_dir_index(my_fsi, remove_inum);
 
     // remove the file block(s) & remove block(s) from allocated block bitarray
-    for(int i = 0; i<remove_inode->block_alloc_count; i++) {
-        block* block_ptr = remove_inode->block_ptrs[i];
-        remove_block_from_bitarray(my_fsi, block_ptr);
-        memset(block_ptr, 0, BLOCK_SIZE);
-    }
+    inode_free_blocks(my_fsi, remove_inum);
 
     // remove its inode from inode table
     memset(remove_inode, 0, sizeof *remove_inode);
+    mark_inode_dirty(my_fsi, remove_inum);
     // remove inode from alloc inode bitarray
-    clear_bit(my_fsi->mfs->inode_alloc, remove_inum);
+    free_inode(my_fsi, remove_inum);
 
     // update parent inode size
-    inode* parent_inode = &my_fsi->mfs->inode_table[pinum];
     parent_inode->size -= sizeof(dir_file_entry);
+    mark_inode_dirty(my_fsi, pinum);
+    mark_block_dirty(my_fsi, cursor.blknum);
 
-    // check if parent directory block is now empty
-    if(dir->d_count == 0) {
-        block* dir_block = (block*)dir;
-
-        // remove allocated block from bitarray
-        remove_block_from_bitarray(my_fsi, dir_block);
-
-        // remove dir from pinum block ptrs + reorder
-        for(int i = 0; i<parent_inode->block_alloc_count; i++) {
-            if (parent_inode->block_ptrs[i] == dir_block) {
-                if (i == parent_inode->block_alloc_count - 1) {
-                    parent_inode->block_ptrs[i] = NULL;
-                } else {
-                    block* last_block_ptr = parent_inode->block_ptrs[parent_inode->block_alloc_count -1];
-                    parent_inode->block_ptrs[i] = last_block_ptr;
-                    parent_inode->block_ptrs[parent_inode->block_alloc_count -1] = NULL;
-                }
-                break;
-            }
-        }
-
+    // check if parent directory block is now empty, hashed directories keep their buckets
+    if(dir != NULL && dir->d_count == 0) {
         // memset 0 the empty dir block
-        memset(dir_block, 0, sizeof *dir_block);
+        memset(dir, 0, sizeof(block));
+
+        // free it and move the following directory blocks down so the directory stays dense
+        inode_collapse_block(my_fsi, pinum, cursor.lblk);
+        renumber_dir_index(my_fsi, pinum, cursor.lblk);
     }
 
-    // write updates to disk
-    force_to_disk(my_fsi);
     return 0;
 }
 
-int SMFS_exec(FSImage* my_fsi, MFS_ClientToServer* request, MFS_ServerToClient* response) {
-    char* cmd = request->cmd;
+int SMFS_unlink(FSImage* my_fsi, int pinum, char* filename) {
+    begin_op(my_fsi);
+    int rc = unlink_file(my_fsi, pinum, filename);
+    end_op(my_fsi);
+    return rc;
+}
+
+typedef int (*op_handler)(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data);
+
+// what a request's data must hold, checked before its handler runs
+typedef enum { DATA_NONE, DATA_NAME, DATA_PATH, DATA_BLOCK, DATA_BLOCKS, DATA_BYTES, DATA_CURSOR } data_kind;
+
+// handlers fill in reply->return_val and return the number of reply data bytes, which are at *data
+// (reply->data unless the handler points it somewhere else, data is NULL if it must stay reply->data)
+
+static int exec_lookup(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    reply->return_val = SMFS_lookup(my_fsi, request->inum, request->data);
+    return 0;
+}
+
+static int exec_lookup_path(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    MFS_Stat_t stat = {0};
+    reply->return_val = SMFS_lookup_path(my_fsi, request->inum, request->data, &stat);
+    memcpy(reply->data, &stat, sizeof stat);
+    return sizeof stat;
+}
+
+/*
+Version of inum for clients that cache its blocks. Take it before reading the inode: the data read afterwards is
+then at least as new as the version says, so a cached copy is never labelled newer than it is.
+*/
+static uint64_t inode_version(FSImage* my_fsi, int inum) {
+    if (!is_valid_inum(my_fsi, inum))
+        return 0;
+    uint32_t* version = &my_fsi->zones[inum / ZONE_INODES]->inode_versions[inum % ZONE_INODES];
+    return (uint64_t)my_fsi->version_epoch << 32 | __atomic_load_n(version, __ATOMIC_ACQUIRE);
+}
 
-    int inum = request->inum;
-    i_type inode_type = request->filetype == MFS_DIRECTORY ? I_DIRECTORY : I_FILE;
-    char* filename = request->filename;
-    char buf[BLOCK_SIZE];
-    memcpy(buf, request->buffer, BLOCK_SIZE);
-    MFS_Stat_t stat= {0};
-    int blkoffset = request->block;
+static int exec_stat(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    MFS_Stat_t stat = {0};
+    reply->version = inode_version(my_fsi, request->inum);
+    reply->return_val = SMFS_stat(my_fsi, request->inum, &stat);
+    memcpy(reply->data, &stat, sizeof stat);
+    return sizeof stat;
+}
+
+static int exec_write(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    reply->return_val = SMFS_write_block(my_fsi, request->inum, request->data, request->arg);
+    return 0;
+}
 
-    int returncode = -1;
-    if (strcmp(cmd, "MFS_Creat") == 0) {
-        returncode = SMFS_create_file(my_fsi, inum, inode_type, filename);
-    } else if (strcmp(cmd, "MFS_Lookup") == 0) {
-        returncode = SMFS_lookup(my_fsi, inum, filename);
+static int exec_read(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    reply->version = inode_version(my_fsi, request->inum);
+    if (!is_valid_inum(my_fsi, request->inum)) {
+        fprintf(stderr, "ERROR: (SMFS_read_block) invalid input\n");
+        reply->return_val = -1;
+        return 0;
+    }
+    char const* src;
+    pthread_rwlock_rdlock(inode_lock(my_fsi, request->inum));
+    // a hashed directory's block is rendered straight into the reply, a batch may hold several replies
+    int bytes_read = read_block_ref(my_fsi, request->inum, request->arg, &src, reply->data);
+    if (bytes_read > 0 && src != reply->data) {
+        if (data)
+            *data = src; // send straight from the image instead of copying the block into the reply
+        else
+            memcpy(reply->data, src, bytes_read);
+    }
+    pthread_rwlock_unlock(inode_lock(my_fsi, request->inum));
+    reply->return_val = bytes_read < 0 ? -1 : 0;
+    return bytes_read < 0 ? 0 : bytes_read;
+}
 
-    } else if (strcmp(cmd, "MFS_Stat") == 0) {
-        returncode = SMFS_stat(my_fsi, inum, &stat);
+static int exec_read_range(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    if (request->count < 1 || request->count > MFS_RANGE_BLOCKS_MAX) {
+        fprintf(stderr, "ERROR: (SMFS_read_blocks) invalid block count %d\n", request->count);
+        reply->return_val = -1;
+        return 0;
+    }
+    reply->version = inode_version(my_fsi, request->inum);
+    int blocks = SMFS_read_blocks(my_fsi, request->inum, reply->data, request->arg, request->count);
+    reply->return_val = blocks;
+    return blocks < 0 ? 0 : blocks * BLOCK_SIZE;
+}
 
-    } else if (strcmp(cmd, "MFS_Write") == 0) {
-        returncode = SMFS_write_block(my_fsi, inum, buf, blkoffset);
-    } else if (strcmp(cmd, "MFS_Read") == 0) {
-        returncode = SMFS_read_block(my_fsi, inum, buf, blkoffset);
+static int exec_write_range(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    reply->return_val = SMFS_write_blocks(my_fsi, request->inum, request->data, request->arg, request->hdr.length / BLOCK_SIZE);
+    return 0;
+}
 
-    } else if (strcmp(cmd, "MFS_Unlink") == 0) {
-        returncode = SMFS_unlink(my_fsi, inum, filename);
-    } else {
-        printf("TODO: NOT IMPLEMENTED CMD %s\n", cmd);
-        return -1;
+static int exec_read_at(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    if (request->count < 0 || request->count > MFS_DATA_MAX) {
+        fprintf(stderr, "ERROR: (SMFS_read_at) invalid byte count %d\n", request->count);
+        reply->return_val = -1;
+        return 0;
     }
+    reply->version = inode_version(my_fsi, request->inum);
+    int bytes = SMFS_read_at(my_fsi, request->inum, reply->data, request->arg, request->count);
+    reply->return_val = bytes;
+    return bytes < 0 ? 0 : bytes;
+}
+
+static int exec_write_at(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    reply->return_val = SMFS_write_at(my_fsi, request->inum, request->data, request->arg, request->hdr.length);
+    return 0;
+}
+
+static int exec_creat(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    i_type inode_type = request->arg == MFS_DIRECTORY ? I_DIRECTORY : I_FILE;
+    reply->return_val = SMFS_create_file(my_fsi, request->inum, inode_type, request->data);
+    return 0;
+}
 
-    memcpy(&response->stat, &stat, sizeof stat);
-    memcpy(response->buffer, buf, BLOCK_SIZE);
-    response->return_val = returncode;
+static int exec_unlink(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    reply->return_val = SMFS_unlink(my_fsi, request->inum, request->data);
     return 0;
 }
 
+static int exec_grow(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    reply->return_val = SMFS_grow(my_fsi, request->arg);
+    return 0;
+}
+
+static int exec_readdir(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply, char const** data) {
+    uint64_t cursor;
+    memcpy(&cursor, request->data, sizeof cursor);
+    int nbytes = request->count < (int)(MFS_DATA_MAX - sizeof cursor) ? request->count : (int)(MFS_DATA_MAX - sizeof cursor);
+    reply->version = inode_version(my_fsi, request->inum);
+    int bytes = SMFS_read_dir(my_fsi, request->inum, &cursor, request->arg, reply->data + sizeof cursor, nbytes);
+    reply->return_val = bytes;
+    if (bytes < 0)
+        return 0;
+    memcpy(reply->data, &cursor, sizeof cursor);
+    return sizeof cursor + bytes;
+}
+
+static struct {
+    op_handler handler;
+    data_kind  data;
+    bool       mutates;
+} const dispatch[MFS_OP_COUNT] = {
+    [MFS_OP_LOOKUP]      = { exec_lookup,      DATA_NAME,   false },
+    [MFS_OP_LOOKUP_PATH] = { exec_lookup_path, DATA_PATH,   false },
+    [MFS_OP_STAT]        = { exec_stat,        DATA_NONE,   false },
+    [MFS_OP_WRITE]       = { exec_write,       DATA_BLOCK,  true  },
+    [MFS_OP_READ]        = { exec_read,        DATA_NONE,   false },
+    [MFS_OP_CREAT]       = { exec_creat,       DATA_NAME,   true  },
+    [MFS_OP_UNLINK]      = { exec_unlink,      DATA_NAME,   true  },
+    [MFS_OP_READ_RANGE]  = { exec_read_range,  DATA_NONE,   false },
+    [MFS_OP_WRITE_RANGE] = { exec_write_range, DATA_BLOCKS, true  },
+    [MFS_OP_GROW]        = { exec_grow,        DATA_NONE,   true  },
+    [MFS_OP_READDIR]     = { exec_readdir,     DATA_CURSOR, false },
+    [MFS_OP_READ_AT]     = { exec_read_at,     DATA_NONE,   false },
+    [MFS_OP_WRITE_AT]    = { exec_write_at,    DATA_BYTES,  true  },
+};
+
+static bool is_valid_request_data(MFS_Request const* request, data_kind kind) {
+    size_t length = request->hdr.length;
+    char const* end = memchr(request->data, '\0', length);
+    switch (kind) {
+        case DATA_NONE:   return true;
+        case DATA_NAME:   return end != NULL && end - request->data < DNAME_MAX;
+        case DATA_PATH:   return end != NULL;
+        case DATA_BLOCK:  return length == BLOCK_SIZE;
+        case DATA_BLOCKS: return length > 0 && length % BLOCK_SIZE == 0;
+        case DATA_BYTES:  return true; // any number of them, none included
+        case DATA_CURSOR: return length == sizeof(uint64_t);
+    }
+    return false;
+}
+
+/*
+Whether executing request can change the image, which invalidates the data of earlier replies that point into it.
+*/
+bool SMFS_is_mutation(MFS_Request const* request) {
+    return request->hdr.opcode < MFS_OP_COUNT && dispatch[request->hdr.opcode].mutates;
+}
+
+/*
+Execute a mutation at most once per (session, request id): a retransmission of one that already ran gets the
+result it had, one that arrives while the original is still executing is dropped (the client sends it again).
+Returns false if there is nothing to reply yet.
+*/
+static bool exec_once(FSImage* my_fsi, MFS_Request* request, MFS_Reply* reply) {
+    uint32_t session_id = request->hdr.session_id, request_id = request->hdr.request_id;
+    pthread_mutex_lock(&my_fsi->replies_lock);
+    reply_state state = reply_cache_begin(&my_fsi->replies, session_id, request_id, &reply->return_val);
+    pthread_mutex_unlock(&my_fsi->replies_lock);
+    if (state == REPLY_IN_PROGRESS)
+        return false;
+    if (state == REPLY_DONE) {
+        // the original's record is logged, but its reply may still be waiting for the group's fsync
+        if (group_depth == 0)
+            sync_log(my_fsi, last_logged_seq(my_fsi));
+        return true;
+    }
+    reply->hdr.length = dispatch[request->hdr.opcode].handler(my_fsi, request, reply, NULL);
+    pthread_mutex_lock(&my_fsi->replies_lock);
+    reply_cache_end(&my_fsi->replies, session_id, request_id, reply->return_val);
+    pthread_mutex_unlock(&my_fsi->replies_lock);
+    return true;
+}
+
+/*
+Execute the request datagram of request_len bytes and build its reply, dispatching on the opcode.
+The reply is the header and fixed fields of *reply followed by reply->hdr.length bytes at *data, which is
+either reply->data or, for a block read, the block in the image (valid until the next mutating request).
+Pass data as NULL when another thread may mutate the image before the reply is sent, the block is then copied
+into reply->data. Mutations from a session (session_id != 0) go through the reply cache, see exec_once().
+Returns the number of reply bytes to send, -1 if there is nothing to send: the datagram is too garbled to answer
+or it repeats a request that is still being executed.
+*/
+int SMFS_exec(FSImage* my_fsi, MFS_Request* request, int request_len, MFS_Reply* reply, char const** data) {
+    char const* reply_data = reply->data;
+    if (data)
+        *data = reply_data;
+    if (request_len < (int)MFS_REQUEST_HEADER_SIZE || request_len != MFS_REQUEST_HEADER_SIZE + request->hdr.length) {
+        fprintf(stderr, "ERROR: (SMFS_exec) malformed request of %d bytes\n", request_len);
+        return -1;
+    }
+
+    reply->hdr = request->hdr;
+    reply->hdr.version = MFS_PROTOCOL_VERSION;
+    reply->hdr.length = 0;
+    reply->return_val = -1;
+    reply->version = 0;
+
+    uint8_t opcode = request->hdr.opcode;
+    if (request->hdr.version != MFS_PROTOCOL_VERSION) {
+        fprintf(stderr, "ERROR: (SMFS_exec) unsupported protocol version %d\n", request->hdr.version);
+    } else if (opcode >= MFS_OP_COUNT) {
+        fprintf(stderr, "ERROR: (SMFS_exec) unknown opcode %d\n", opcode);
+    } else if (!is_valid_request_data(request, dispatch[opcode].data)) {
+        fprintf(stderr, "ERROR: (SMFS_exec) invalid data for opcode %d\n", opcode);
+    } else if (dispatch[opcode].mutates && request->hdr.session_id != 0) {
+        if (!exec_once(my_fsi, request, reply))
+            return -1;
+    } else {
+        reply->hdr.length = dispatch[opcode].handler(my_fsi, request, reply, data ? &reply_data : NULL);
+        if (data)
+            *data = reply_data;
+    }
+    return MFS_REPLY_HEADER_SIZE + reply->hdr.length;
+}
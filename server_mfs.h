@@ -1,15 +1,31 @@
 #pragma once
 
+#include <pthread.h>
 #include <stdint.h>
 #include "bitarray.h"
+#include "dir_index.h"
+#include "journal.h"
 #include "mfs.h"
+#include "reply_cache.h"
 
-#define INODE_TABLE_SIZE 4096
-#define BLOCK_COUNT      4096
+#define ZONE_INODES      4096   // the volume grows one zone at a time, each with its own bitmaps, inodes and blocks
+#define ZONE_BLOCKS      4096
+#define ZONES_MAX        4096   // 16M inodes and 16M blocks (64 GB)
+#define GROW_FREE_MIN    512    // fewer free inodes or blocks than this adds a zone in the background
 #define BLOCK_SIZE       4096
-#define BLOCK_PTRS       10
+#define BLOCK_PTRS       10     // blocks of a legacy directory (and of any file before version 4)
 #define DNAME_MAX        252
 #define DENTRIES_MAX     16     // (blocksize - d_count - reserved) [4094 bytes] / dir entry size [254 bytes]
+#define DIR_BUCKETS_MAX  (1 << 14) // blocks of a hashed directory, a few hundred entries fit in each
+#define DIR_SPLIT_USED   3072   // bytes of records in a bucket past which inserting into it adds a bucket
+#define EXTENTS_MAX      BLOCK_PTRS // extents in an inode, or leaf blocks once they don't fit there
+#define LEAF_EXTENTS_MAX 341    // (blocksize - count - reserved) [4092 bytes] / extent size [12 bytes]
+#define INDEX_ENTRIES_MAX 341   // (blocksize - count - reserved) [4092 bytes] / index entry size [12 bytes]
+#define EXTENT_DEPTH_MAX 4      // levels of index above the extents, FILE_BLOCKS_MAX extents need 2 at most
+#define FILE_BLOCKS_MAX  (1 << 18) // 1 GB, so a file's size still fits in MFS_Stat_t
+#define PREALLOC_BLOCKS  4      // blocks reserved past the end of a growing regular file
+#define CHECKPOINT_LOG_BYTES (4 << 20) // redo log size that wakes the checkpointer
+#define INODE_LOCK_STRIPES 64   // inode inum is guarded by inode_locks[inum % INODE_LOCK_STRIPES]
 
 typedef struct dir_file_entry_ {
     int     inode_num;
@@ -23,43 +39,180 @@ typedef struct dir_file_ {
     char           padding[30]; // 16*254 + 1 + 1 + 30 = 4096
 } dir_file;
 
+// entry of a hashed directory, records are chained by rec_len and 4-byte aligned
+typedef struct dir_record_ {
+    int32_t  inode_num;
+    uint16_t rec_len;   // bytes up to the next record, unused space after this record's name included
+    uint8_t  name_len;  // 0 = unused space, the first record of a bucket can't be merged into a previous one
+    uint8_t  reserved;
+    char     name[];    // name_len bytes and a '\0'
+} dir_record;
+
+// block of a hashed directory: the bucket its names hash to (linear hashing over the directory's blocks)
+typedef struct dir_bucket_ {
+    uint16_t count;     // records in use
+    uint16_t used;      // bytes taken by them
+    uint32_t reserved;
+    char     records[BLOCK_SIZE - 8]; // covered by the record chain
+} dir_bucket;
+
 typedef struct file_file_ {
     char f_data[BLOCK_SIZE];
 } file_file;
 
+typedef enum { I_EMPTY, I_DIRECTORY, I_FILE } i_type;
+
+// file blocks [lblk, lblk+length) live in data blocks [start, start+length)
+typedef struct extent_ {
+    uint32_t lblk;
+    uint32_t start;
+    uint32_t length;
+} extent;
+
+// a block of extents, for a file with more than EXTENTS_MAX of them
+typedef struct extent_leaf_ {
+    uint16_t count;
+    uint16_t reserved;
+    extent   extents[LEAF_EXTENTS_MAX]; // sorted by lblk
+} extent_leaf;
+
+// block holding the extents (a leaf) or the index entries (an index block) from file block lblk up to the next
+// entry's lblk
+typedef struct extent_idx_ {
+    uint32_t lblk;                   // 0 for the first entry
+    uint32_t child;
+    uint32_t reserved;
+} extent_idx;
+
+// a block of index entries, between the inode's index and the leaves once they don't fit there
+typedef struct extent_index_ {
+    uint16_t   count;
+    uint16_t   reserved;
+    extent_idx entries[INDEX_ENTRIES_MAX]; // sorted by lblk
+} extent_index;
+
 typedef union block_ {
-    file_file b_file;
-    dir_file  b_directory;
+    file_file   b_file;
+    dir_file    b_directory;
+    dir_bucket  b_bucket;
+    extent_leaf b_extents;
+    extent_index b_index;
 } block;
 
-typedef enum { I_EMPTY, I_DIRECTORY, I_FILE } i_type;
-
 typedef struct inode_ {
-    unsigned size;
-    unsigned block_alloc_count;
-    block*   block_ptrs[BLOCK_PTRS];
+    uint64_t size;
+    uint32_t block_alloc_count;      // blocks mapped by extents, preallocated, leaf and index blocks not included
+    uint16_t extent_count;           // entries of extents[] or index[]
+    uint16_t prealloc_length;        // blocks reserved (allocated but unmapped) from prealloc_start on
+    uint32_t prealloc_start;
+    uint16_t extent_depth;           // 0 = extents[] map the file, 1 = index[] points at leaf blocks that do,
+                                     // n = index[] points at index blocks n - 1 levels above the leaves
+    uint16_t flags;
+    union {
+        extent     extents[EXTENTS_MAX]; // sorted by lblk, file blocks not covered are holes
+        extent_idx index[EXTENTS_MAX];   // sorted by lblk
+    };
     i_type   type;
 } inode;
 
-typedef struct SMFS_ {
+#define INODE_DIR_HASHED 0x1 // a directory made of dir_buckets, dir_files otherwise (every directory before version 6)
+
+#define SMFS_MAGIC   0x4953464d // "MFSI" on disk
+#define SMFS_VERSION 7          // 1 = no superblock, raw block* in inodes; 2 = block_nums[] in inodes;
+                                // 3 = 32-bit size, extents only in the inode; 4 = one fixed size zone;
+                                // 5 = no hashed directories; 6 = one level of extent index at most
+
+// the first BLOCK_SIZE bytes of the image, followed by zone_count zones
+typedef struct superblock_ {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t inode_count;  // zone_count * zone_inodes
+    uint32_t block_count;  // zone_count * zone_blocks
+    uint32_t zone_inodes;
+    uint32_t zone_blocks;
+    uint32_t zone_count;
+} superblock;
+
+// inode zone * ZONE_INODES + i is inode_table[i] of zone zone, blocks are numbered the same way
+typedef struct SMFS_zone_ {
     bitarray inode_alloc;
     bitarray block_alloc;
-    inode inode_table[INODE_TABLE_SIZE];
-    block data_blocks[BLOCK_COUNT];
-} SMFS;
+    char     reserved[BLOCK_SIZE - 2 * sizeof(bitarray)]; // keeps the zone's blocks block aligned in the file
+    inode inode_table[ZONE_INODES];
+    block data_blocks[ZONE_BLOCKS];
+} SMFS_zone;
+
+#define ZONES_OFFSET ((uint64_t)BLOCK_SIZE) // of zone 0 in the image
+
+typedef enum { FSI_BUFFERED, FSI_MMAP } fsi_mode;
+
+// regions of one zone
+typedef struct dirty_set_ {
+    bitarray alloc_words; // bits [0,128) = inode_alloc words, [128,256) = block_alloc words
+    bitarray inodes;
+    bitarray blocks;
+} dirty_set;
+
+// a zone's part of the image, in memory, and its allocation state
+typedef struct zone_ {
+    SMFS_zone* disk;      // mapped or loaded, never moves (directory index entries point into its blocks)
+    dirty_set unflushed;  // regions logged but not yet written back to the image by a checkpoint
+    bitarray_hint inode_hint; // next-fit position + free count of inode_alloc
+    bitarray_hint block_hint; // next-fit position + free count of block_alloc
+    uint32_t inode_versions[ZONE_INODES]; // bumped by every operation that changes the inode or its blocks
+} zone;
 
 typedef struct FSImage_ {
     int fd;
-    SMFS* mfs;
+    superblock* sb;
+    fsi_mode mode;
+    zone* zones[ZONES_MAX];   // [0, zone_count) are in use
+    uint32_t zone_count;      // only grows, read it with zone_count() unless block_alloc_lock is held
+    uint32_t zones_max;       // the volume doesn't grow past this
+    uint32_t inode_zone;      // where the next inode and block searches start
+    uint32_t block_zone;
+    int64_t free_inodes;      // over all zones, updated atomically
+    int64_t free_blocks;
+    bool grow_wanted;         // below GROW_FREE_MIN, the checkpointer adds a zone
+    bitarray unflushed_zones; // zones with anything in their unflushed set
+    journal log;          // redo log next to the image ('<fsi>.mfsj')
+    uint64_t synced_seq;  // log records up to this seq are durable
+    bool log_syncing;     // a thread is in journal_sync(), the others wait on log_synced_cv instead of syncing too
+    dir_index dirs;       // (pinum, name) -> directory entry, a directory is indexed on its first lookup
+    reply_cache replies;  // results of recent mutations, for answering retransmissions
+    uint32_t version_epoch; // picked when the image is opened, so inode versions never repeat across restarts
+    // locks, taken in this order (see server_mfs.c)
+    pthread_rwlock_t checkpoint_lock;                    // shared by mutations, exclusive while checkpointing
+    pthread_rwlock_t inode_locks[INODE_LOCK_STRIPES];    // inodes and the data blocks they map
+    pthread_rwlock_t dirs_lock;                          // dirs
+    pthread_mutex_t  inode_alloc_lock;                   // inode_alloc + inode_hint of every zone, inode_zone
+    pthread_mutex_t  block_alloc_lock;                   // block_alloc + block_hint of every zone, block_zone, growth
+    pthread_mutex_t  log_lock;                           // log, unflushed sets and the sync state, grow_wanted
+    pthread_mutex_t  replies_lock;                       // replies, never held with any other lock
+    pthread_cond_t log_synced_cv;
+    pthread_cond_t checkpoint_cv;
+    pthread_t checkpointer;
 } FSImage;
 
-FSImage* SMFS_open_file_system_image (char const* fsi);
+FSImage* SMFS_open_file_system_image (char const* fsi, fsi_mode mode);
+void     SMFS_close_file_system_image(FSImage* my_fsi);
 int      SMFS_init_file_system_image (FSImage* my_fsi);
-int      SMFS_exec                   (FSImage* my_fsi, MFS_ClientToServer* request, MFS_ServerToClient* response);
+int      SMFS_exec                   (FSImage* my_fsi, MFS_Request* request, int request_len, MFS_Reply* reply, char const** data);
+bool     SMFS_is_mutation            (MFS_Request const* request);
+void     SMFS_begin_group            (FSImage* my_fsi);
+void     SMFS_end_group              (FSImage* my_fsi);
+void     SMFS_set_max_zones          (FSImage* my_fsi, uint32_t zones);
+int      SMFS_grow                   (FSImage* my_fsi, int zones);
 
 int      SMFS_lookup                 (FSImage* my_fsi, int pinum, char* name);
+int      SMFS_lookup_path            (FSImage* my_fsi, int pinum, char const* path, MFS_Stat_t* stat);
 int      SMFS_create_file            (FSImage* my_fsi, int pinum, i_type type, char const* filename);
 int      SMFS_read_block             (FSImage* my_fsi, int inum, char* buffer, int blkoffset);
 int      SMFS_write_block            (FSImage* my_fsi, int inum, char* buffer, int blkoffset);
+int      SMFS_read_blocks            (FSImage* my_fsi, int inum, char* buffer, int blkoffset, int count);
+int      SMFS_write_blocks           (FSImage* my_fsi, int inum, char const* buffer, int blkoffset, int count);
+int      SMFS_read_at                (FSImage* my_fsi, int inum, char* buffer, int offset, int nbytes);
+int      SMFS_write_at               (FSImage* my_fsi, int inum, char const* buffer, int offset, int nbytes);
+int      SMFS_read_dir               (FSImage* my_fsi, int inum, uint64_t* cursor, int flags, char* buffer, int nbytes);
 int      SMFS_stat                   (FSImage* my_fsi, int inum, MFS_Stat_t* stat);
 int      SMFS_unlink                 (FSImage* my_fsi, int pinum, char* filename);
\ No newline at end of file
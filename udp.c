@@ -1,11 +1,10 @@
+#define _GNU_SOURCE // recvmmsg, sendmmsg
 #include "udp.h"
 
 #define h_addr h_addr_list[0] /* silences compiler warning */
 
-// create a socket and bind it to a port on the current machine
-// used to listen for incoming packets
-int
-UDP_Open(int port)
+static int
+udp_open(int port, int shared)
 {
     int fd;
     if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
@@ -13,6 +12,13 @@ UDP_Open(int port)
 	return 0;
     }
 
+    int on = 1;
+    if (shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+	perror("setsockopt");
+	close(fd);
+	return -1;
+    }
+
     // set up the bind
     struct sockaddr_in myaddr;
     bzero(&myaddr, sizeof(myaddr));
@@ -31,6 +37,35 @@ UDP_Open(int port)
     return fd;
 }
 
+// create a socket and bind it to a port on the current machine
+// used to listen for incoming packets
+int
+UDP_Open(int port)
+{
+    return udp_open(port, 0);
+}
+
+// like UDP_Open, but several sockets can be bound to the same port (SO_REUSEPORT),
+// the kernel spreads incoming datagrams across them by source address
+int
+UDP_OpenShared(int port)
+{
+    return udp_open(port, 1);
+}
+
+// ask for socket buffers of at least bytes each way, so a burst of that much can queue without being dropped
+// (the kernel caps it at net.core.rmem_max/wmem_max)
+int
+UDP_SetBufferSize(int fd, int bytes)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) == -1 ||
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)) == -1) {
+	perror("setsockopt");
+	return -1;
+    }
+    return 0;
+}
+
 // fill sockaddr_in struct with proper goodies
 int
 UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port)
@@ -64,6 +99,34 @@ UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n)
     return rc;
 }
 
+// receive up to n datagrams with one system call, msgs[i].msg_len is set to the size of each
+// returns the number received, -1 on error (flags as for recvmmsg, e.g. MSG_WAITFORONE)
+int
+UDP_ReadBatch(int fd, struct mmsghdr *msgs, int n, int flags)
+{
+    for (int i = 0; i < n; i++)
+	msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    int rc = recvmmsg(fd, msgs, n, flags, NULL);
+    return rc;
+}
+
+// send n datagrams, as few system calls as the kernel allows
+// returns the number sent, fewer than n only on error
+int
+UDP_WriteBatch(int fd, struct mmsghdr *msgs, int n)
+{
+    int sent = 0;
+    while (sent < n) {
+	int rc = sendmmsg(fd, msgs + sent, n - sent, 0);
+	if (rc < 0) {
+	    perror("sendmmsg");
+	    break;
+	}
+	sent += rc;
+    }
+    return sent;
+}
+
 int
 UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n)
 {
@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <netinet/tcp.h>
 #include <netinet/in.h>
@@ -28,11 +29,17 @@
 // 
 
 int UDP_Open(int port);
+int UDP_OpenShared(int port);
 int UDP_Close(int fd);
+int UDP_SetBufferSize(int fd, int bytes);
 
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n);
 int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n);
 
+struct mmsghdr; // <sys/socket.h> only defines it with _GNU_SOURCE
+int UDP_ReadBatch(int fd, struct mmsghdr *msgs, int n, int flags);
+int UDP_WriteBatch(int fd, struct mmsghdr *msgs, int n);
+
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port);
 
 #endif // __UDP_h__
\ No newline at end of file